@@ -0,0 +1,91 @@
+/*******************************************************************************
+ * alphabets.h
+ * Description - the symbol sets a message and its key may be written in,
+ * defined once for keygen, the clients, the daemons and otp_load. A v2
+ * request names its alphabet by index in V2_FLAG_ALPHABET (v1 requests are
+ * always ALPHA_TEXT), so the order here is part of the protocol. A
+ * symbol's value is its place in symbols, and the cipher adds or subtracts
+ * values mod the alphabet's size.
+ *
+ * initAlphabets expands each one into lookup tables at start up, so the
+ * loops that check and cipher text carry no alphabet logic: value takes a
+ * byte to its value, ALPHA_INVALID for bytes outside the alphabet, and
+ * wrap takes a value up to twice the size to its symbol, the mod done in
+ * the table. Every valid value is under 0x80 and ALPHA_INVALID is not, so
+ * a loop can OR the values it looked up and test that bit once at the end.
+ *
+ * ****************************************************************************/
+#ifndef ALPHABETS_H
+#define ALPHABETS_H
+
+#include <string.h>
+
+#define ALPHA_TEXT 0         // "A" - "Z" and " ", the original alphabet
+#define ALPHA_ALNUM 1        // "A" - "Z", "a" - "z" and "0" - "9"
+#define ALPHA_BASE64 2       // alnum with "+" and "/"
+#define NUM_ALPHABETS 3
+#define MAX_SYMBOLS 64
+#define ALPHA_INVALID 0xFF   // value of a byte outside the alphabet
+#define ALPHA_BAD_BIT 0x80   // set in ALPHA_INVALID, never in a real value
+#define WRAP_MASK (2 * MAX_SYMBOLS - 1)   // keeps any index inside wrap
+
+#define UPPER "ABCDEFGHIJKLMNOPQRSTUVWXYZ"
+#define LOWER "abcdefghijklmnopqrstuvwxyz"
+#define DIGITS "0123456789"
+
+struct alphabet {
+	const char* name;
+	const char* symbols;
+	int size;                      // number of symbols, the modulus
+	unsigned char value[256];      // byte to its value
+	char wrap[2 * MAX_SYMBOLS];    // value to symbol, mod size
+};
+
+static struct alphabet alphabets[NUM_ALPHABETS] = {
+	{ .name = "text", .symbols = UPPER " " },
+	{ .name = "alnum", .symbols = UPPER LOWER DIGITS },
+	{ .name = "base64", .symbols = UPPER LOWER DIGITS "+/" },
+};
+
+
+
+
+/*******************************************************************************
+ * initAlphabets
+ * fills in each alphabet's size and lookup tables.
+ *
+ * ****************************************************************************/
+static inline void initAlphabets(){
+	struct alphabet* a;
+	int i, v;
+
+	for (i = 0; i < NUM_ALPHABETS; i++){
+		a = &alphabets[i];
+		a->size = strlen(a->symbols);
+		memset(a->value, ALPHA_INVALID, sizeof(a->value));
+		for (v = 0; v < a->size; v++)
+			a->value[(unsigned char)a->symbols[v]] = v;
+		for (v = 0; v < 2 * a->size; v++)
+			a->wrap[v] = a->symbols[v % a->size];
+	}
+}
+
+
+
+
+/*******************************************************************************
+ * findAlphabet
+ * the index of the alphabet called name, or -1.
+ *
+ * ****************************************************************************/
+static inline int findAlphabet(const char* name){
+	int i;
+
+	for (i = 0; i < NUM_ALPHABETS; i++){
+		if (strcmp(alphabets[i].name, name) == 0)
+			return(i);
+	}
+	return(-1);
+}
+
+#endif
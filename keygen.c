@@ -6,6 +6,10 @@
  * a key of said length with a newline character appended to it. The key will 
  * consist of pseudo-random upper case alpabet chars and the "space" char. 
  * So: "A - Z" and " ".  After generating the key, it is output to standard out.
+ * -a alnum or -a base64 draws the key from that alphabet instead, as the
+ * clients' -a does.
+ * With -b the key is a binary pad instead: keyLength random bytes from
+ * /dev/urandom, any value, and no newline, for the clients' -b mode.
  * 
  * ****************************************************************************/
 
@@ -13,49 +17,34 @@
 #include <stdlib.h>
 #include <string.h>
 #include <time.h>
+#include <unistd.h>
 
-
-
-
-
-
-
+#include "alphabets.h"
 
 
 
 /*******************************************************************************
  * createKey
- * 
+ * writes keyLength random symbols of the alphabet symbols, and a newline.
  *
  * ****************************************************************************/
-void createKey(int keyLength){
+void createKey(int keyLength, const char* symbols){
 	int i;           // for looping
-	int randVal;   // holds randomly generated value
+	int size = strlen(symbols);   // symbols to choose from
 		
 	// check keyLength was bigger than 0 or that atoi conv worked
 	if (keyLength == 0){
-		fprintf(stderr, "%s\n", "Useage2: keygen <int lengthOfKey>");
+		fprintf(stderr, "%s\n", "Useage2: keygen [-a alphabet] "
+				"<int lengthOfKey>");
 		exit(1);
 	}
 
 	// create array to hold the key
 	char* theKey = calloc(keyLength + 1, sizeof(char));
 	
-	// fill the key with spaces and random capital letters
-	for (i = 0; i < keyLength; i++){
-		// get a random number between 0 - 26
-		randVal = rand() % 27;
-		// adjust it so it coorelates to ascii capital letters
-		randVal += 65;
-
-		// convert the random number to " " or "A - Z"
-		if (randVal == 91){
-			theKey[i] = ' ';
-		}
-		else {
-			theKey[i] = (char)randVal;
-		}
-	}
+	// fill the key with random symbols
+	for (i = 0; i < keyLength; i++)
+		theKey[i] = symbols[rand() % size];
 
 	// add the trailing newline
 	theKey[keyLength] = '\n';
@@ -70,22 +59,92 @@ void createKey(int keyLength){
 
 
 
+/*******************************************************************************
+ * createBinaryKey
+ * writes keyLength bytes from the kernel's random source to stdout, as they
+ * come, a chunk at a time.
+ *
+ * ****************************************************************************/
+void createBinaryKey(long keyLength){
+	char chunk[65536];   // random bytes on their way out
+	size_t want;         // bytes wanted in this chunk
+	FILE* random;
+
+	if (keyLength <= 0){
+		fprintf(stderr, "%s\n",
+				"Useage2: keygen -b <int lengthOfKey>");
+		exit(1);
+	}
+
+	random = fopen("/dev/urandom", "rb");
+	if (random == NULL){
+		perror("keygen: /dev/urandom");
+		exit(1);
+	}
+	while (keyLength > 0){
+		want = sizeof(chunk);
+		if (keyLength < (long)want)
+			want = keyLength;
+		if (fread(chunk, 1, want, random) != want ||
+				fwrite(chunk, 1, want, stdout) != want){
+			perror("keygen");
+			exit(1);
+		}
+		keyLength -= want;
+	}
+	fclose(random);
+}
+
+
+
+
+
+
+
 /*******************************************************************************
  * main
  * 
  *
  * ****************************************************************************/
 int main(int argc, char* argv[]){	
+	int binary = 0;   // -b: a binary pad
+	int alphabet = ALPHA_TEXT; // -a: the alphabet
+	int badOpt = 0;   // an option we do not know, or -b with -a
+	int opt;
+
+	while ((opt = getopt(argc, argv, "ba:")) != -1){
+		if (opt == 'b')
+			binary = 1;
+		else if (opt == 'a'){
+			alphabet = findAlphabet(optarg);
+			if (alphabet < 0)
+				badOpt = 1;
+		}
+		else
+			badOpt = 1;
+	}
+
+	// a binary pad has no alphabet
+	if (binary && alphabet != ALPHA_TEXT)
+		badOpt = 1;
+
 	// check for proper argc amount
-	if (argc < 2 || argc > 2){
-		fprintf(stderr, "%s\n", "Useage1: keygen <int lengthOfKey>");
+	if (badOpt || argc - optind != 1){
+		fprintf(stderr, "%s\n", "Useage1: keygen [-b | -a alphabet] "
+				"<int lengthOfKey>");
+		exit(1);
+	}
+
+	if (binary){
+		createBinaryKey(atol(argv[optind]));
+		return(0);
 	}
 	
 	// seed a pseudo random num generator
 	srand(time(NULL));
 
 	// create the key
-	createKey(atoi(argv[1]));
+	createKey(atoi(argv[optind]), alphabets[alphabet].symbols);
 
 	return(0);
 }
@@ -2,26 +2,71 @@
  * otp_dec.c
  * Parker Howell
  * 12-1-17
- * Usage - "opt_dec <ciphertext> <keytext> <serverport>"
+ * Usage - "opt_dec [-j connections] [-m] [-o outfile] <ciphertext|->
+ *                  <keytext> <serverport[,serverport...]>"
+ *         "opt_dec -B <index> [-o outdir] [-j connections] <keytext>
+ *                  <serverport[,serverport...]>"
+ *         (each form also takes [-P tuning], [-C], [-b] and [-a alphabet])
  * Description - checks that the keytext is of valid length (at least as long
  * as the ciphertext) that both cipher and key texts do not contain invalid 
  * characters, and then connects to the otp_dec_d server specified at 
- * serverport. Once connected this program sends the information to the server
- * so it can be encoded. It then waits for the server to return the encoded
- * message and once recieved, prints the encoded message to stdout.
+ * serverport (or the least loaded of a list of them). Once connected this
+ * program sends the information to the server so it can be encoded. It
+ * then waits for the server to return the encoded message and once
+ * recieved, prints the encoded message to stdout.
  *
  * ****************************************************************************/
 
 
+#define _GNU_SOURCE     // splice
 #include <stdio.h>
 #include <stdlib.h>
+#include <stdint.h>
+#include <endian.h>
 #include <unistd.h>
 #include <string.h>
 #include <sys/types.h>
 #include <sys/socket.h>
 #include <netinet/in.h>
+#include <netinet/tcp.h>
 #include <netdb.h> 
 #include <sys/ioctl.h>
+#include <sys/uio.h>
+#include <poll.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <dirent.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <sys/mman.h>
+
+#include "alphabets.h"
+#include "protocol.h"
+
+
+// largest chunk a streamed request sends at once
+#define STREAM_CHUNK 65536
+
+// times a connection turned away by a busy daemon is tried again
+#define MAX_RETRIES 8
+
+// longest a busy daemon's suggested wait is waited for after "retry"
+#define RETRY_READ_MS 1000
+
+// buffers this big are mapped from huge pages
+#define HUGE_PAGE (2L << 20)
+#ifndef MADV_POPULATE_WRITE
+#define MADV_POPULATE_WRITE 23         // Linux 5.14, older headers lack it
+#endif
+
+
+// carries results bound for an output file from the socket to the file
+int splicePipe[2] = { -1, -1 };
+
+// -b: any bytes, XORed with a binary pad, so files and results carry no
+// trailing newline
+int binary = 0;
+int newline = 1;
 
 
 
@@ -62,6 +107,78 @@ int getSizeOf(char* theFile){
 
 
 
+/*******************************************************************************
+ * allocBuff
+ * returns a zeroed buffer of size bytes for a whole message or key, to be
+ * freed with freeBuff. From a huge page up it is mapped from huge pages
+ * (the hugetlb pool if the host has one, transparent huge pages otherwise)
+ * and faulted in at once, which saves a page fault and TLB miss per 4KB on
+ * large files. The kernel hands such memory over zeroed, so it is not
+ * cleared again. Mapped buffers are listed in hugeBuffs for freeBuff.
+ *
+ * ****************************************************************************/
+struct hugeBuff {
+	char* buff;
+	long size;
+};
+struct hugeBuff* hugeBuffs = NULL;
+int numHuge = 0;
+
+char* allocBuff(long size){
+	char* buff;
+
+	if (size < HUGE_PAGE){
+		buff = calloc(size, sizeof(char));
+		if (buff == NULL)
+			error("CLIENT: ERROR allocating memory");
+		return(buff);
+	}
+
+	size = (size + HUGE_PAGE - 1) & ~(HUGE_PAGE - 1);
+	buff = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_PRIVATE |
+			MAP_ANONYMOUS | MAP_HUGETLB | MAP_POPULATE, -1, 0);
+	if (buff == MAP_FAILED){
+		buff = mmap(NULL, size, PROT_READ | PROT_WRITE,
+				MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+		if (buff == MAP_FAILED)
+			error("CLIENT: ERROR allocating memory");
+		madvise(buff, size, MADV_HUGEPAGE);
+		madvise(buff, size, MADV_POPULATE_WRITE);
+	}
+
+	hugeBuffs = realloc(hugeBuffs, (numHuge + 1) * sizeof(struct hugeBuff));
+	if (hugeBuffs == NULL)
+		error("CLIENT: ERROR allocating memory");
+	hugeBuffs[numHuge].buff = buff;
+	hugeBuffs[numHuge].size = size;
+	numHuge++;
+	return(buff);
+}
+
+
+
+
+/*******************************************************************************
+ * freeBuff
+ * frees a buffer from allocBuff.
+ *
+ * ****************************************************************************/
+void freeBuff(char* buff){
+	int i;
+
+	for (i = 0; i < numHuge; i++){
+		if (hugeBuffs[i].buff == buff){
+			munmap(buff, hugeBuffs[i].size);
+			hugeBuffs[i] = hugeBuffs[--numHuge];
+			return;
+		}
+	}
+	free(buff);
+}
+
+
+
+
 /*******************************************************************************
  * fillBuff
  * opens theFile and reads the contents into buffer. closes the file when done.
@@ -90,21 +207,33 @@ void fillBuff(char* theFile, int fileLength, char* buffer){
 
 
 
+// -a: the alphabet in use, from alphabets.h, and named to the daemon by
+// V2_FLAG_ALPHABET
+int alphabet = ALPHA_TEXT;
+
+
+
+
 /*******************************************************************************
  * checkBuff
- * checks theBuff buffer for any characters that aren't either "A - Z" or the
- * space " " character. If found an error message is printed to stderr and the
- * program exits. If no errors are found the function simply returns.
+ * checks theBuff buffer for any characters that aren't in the alphabet (by
+ * default "A - Z" or the space " " character). If found an error message is
+ * printed to stderr and the program exits. If no errors are found the
+ * function simply returns. A binary pad (-b) takes any byte, so then there
+ * is nothing to check.
  * 
  * ****************************************************************************/
 void checkBuff(char* theBuff, int buffSize){
+	unsigned char* value = alphabets[alphabet].value;
 	int i;    // for looping
 
+	if (binary)
+		return;
+
 	// check every char in the buffer
 	for (i = 0; i < buffSize - 1; i++){
-		// if the char isnt "A - Z" or " "
-		if (((theBuff[i] < 65) && (theBuff[i] != 32)) 
-				|| (theBuff[i] > 90)){
+		// if the char isnt in the alphabet
+		if (value[(unsigned char)theBuff[i]] == ALPHA_INVALID){
 			//printf("bad char %c at buffer index %d\n", 
 			//		theBuff[i], i);
 			fprintf(stderr, 
@@ -118,131 +247,250 @@ void checkBuff(char* theBuff, int buffSize){
 
 
 /*******************************************************************************
- * main
- * performs argument validation and checks the input files. Then proceeds to
- * assemble the message to be sent for encryption. Once the message is ready
- * main opens up a network connection to the server and sends the message to
- * it. It then waits for the return encrypted message and once recieved, prints
- * that encrypted message to stdout.
+ * fillKeyRange
+ * reads only the length key bytes starting at offset of the pad keyFile
+ * (keyLength bytes long, newline included) into buffer and checks them. The
+ * rest of the pad is neither read nor checked.
  *
  * ****************************************************************************/
-int main(int argc, char *argv[])
-{
-	int socketFD, portNumber, charsWritten, charsRead;
-	int cipherLength;          // size of the cipherText message
-	int keyLength;            // size of the enc/dec key
-	int msgSize;              // size of msg to send to server
-	struct sockaddr_in serverAddress;
-	struct hostent* serverHostInfo;
-    
-	// Check usage & args
-	if (argc < 4 || argc > 4) { 
-		fprintf(stderr,"USAGE: %s ciphertext key port\n", argv[0]); 
-		exit(1); 
-	} 
-	
-	// Get and validate the port number
-	// convert to an integer from a string
-	portNumber = atoi(argv[3]); 
-	if (portNumber < 0 || portNumber > 65535){
-		fprintf(stderr, "Invalid port number\n");
+void fillKeyRange(char* keyFile, long keyLength, long offset, int length,
+		char* buffer){
+	int fd;   // the pad
+
+	if (offset < 0 || offset + length > keyLength - newline){
+		fprintf(stderr, "Error: key '%s' is too short\n", keyFile);
 		exit(1);
 	}
 
-	// get the size of the cipher text and key text files.
-	cipherLength = getSizeOf(argv[1]);
-	keyLength = getSizeOf(argv[2]);
-	//printf("cipherText is %d bytes long\n", cipherLength);
-	//printf("keyText is %d bytes long\n", keyLength);
-
-	// check if key text is at least as long as the ciphertext
-	if (keyLength < cipherLength){
-		fprintf(stderr, "Error: key '%s' is too short\n", argv[2]);
+	fd = open(keyFile, O_RDONLY);
+	if (fd < 0){
+		fprintf(stderr, "Error opening file: %s\n", keyFile);
 		exit(1);
 	}
+	if (pread(fd, buffer, length, offset) != length)
+		error("CLIENT: ERROR reading key");
+	close(fd);
 
-	// meke buffers so we can read cipherText and keyText into them
-	char* cipherBuff = calloc(cipherLength, sizeof(char)); 
-	char* keyBuff = calloc(keyLength, sizeof(char));
+	checkBuff(buffer, length + 1);
+}
 
-	//printf("CLIENT: cipherBuff is %d bytes large\n", cipherLength);
-	//printf("CLIENT: keyBuff is %d bytes large\n", keyLength);
-	
-	
-	// fill those buffers with the ciphertext and keytext file contents
-	fillBuff(argv[1], cipherLength, cipherBuff);
-	//printf("cipherBuff: ..%s..\n", cipherBuff);
-	fillBuff(argv[2], keyLength, keyBuff);
-	//printf("keyBuff: ..%s..\n", keyBuff);
-	
-	// remove trailing newlines from buffers
-	cipherBuff[cipherLength - 1] = '\0';
-	keyBuff[keyLength - 1] = '\0';
-	
-	// check that the buffers contain valid characters " " or "A - Z"
-	checkBuff(cipherBuff, cipherLength);
-	checkBuff(keyBuff, keyLength);
 
-	//printf("CLIENT: cipherBuff has %d bytes in it\n", strlen(cipherBuff));
-	//printf("CLIENT: keyBuff has %d bytes in it\n", strlen(keyBuff));
 
 
-	// create the Msg we will send to the server
-	// get the size we will need for Msg buffer
-	// (+ 13) -  for the msg designator D, the 10 byte msg length count,
-	// the sentinel @, and terminator '\0'.
-	msgSize = (strlen(cipherBuff) * 2) + 13;
-	//printf("msgSize is: %d\n", msgSize);
+/*******************************************************************************
+ * keyPrefix
+ * looks for the "offset:" prefix otp_enc -k puts before a ciphertext. If it
+ * is there, stores the key offset in offset and returns the prefix length,
+ * otherwise returns 0.
+ *
+ * ****************************************************************************/
+int keyPrefix(char* buff, int length, long* offset){
+	int i = 0;
+
+	while (i < length && buff[i] >= '0' && buff[i] <= '9')
+		i++;
+	if (i == 0 || i >= length || buff[i] != ':')
+		return(0);
+
+	*offset = atol(buff);
+	return(i + 1);
+}
 
-	// create the Msg buffer
-	char* msgBuff = calloc(msgSize, sizeof(char));
-	
-	// designate that msg is from opt_Dec
-	strcat(msgBuff, "D");
 
 
 
-	// make a string out of the length of cipher text file
-	// the string will always be 10 bytes long with leading zeros padding
-	// any unused bytes.  ex:  0000001351  for a file 1351 bytes in size.
-	int i;
-	int cipherSize;
-	char* tempBuff = calloc(11, sizeof(char));
-	
-	// convert the int size of ciphertext msg, to a string in tempBuff
-	sprintf(tempBuff, "%d", cipherLength - 1);
-	// get how many bytes long that string is
-	cipherSize = strlen(tempBuff);
-	// find out how many leading zeros we need to ensure standardized
-	// 10 byte length.
-	cipherSize = 10 - cipherSize;
-	// concatenate the leading zeros
-	for (i = 0; i < cipherSize; i++){
-		strcat(msgBuff, "0");
+/*******************************************************************************
+ * protocol v2
+ * requests go out with the header in protocol.h, and are sent again in v1
+ * to a daemon that answers it with "error". With -C the header has
+ * V2_FLAG_CRC set, with -b V2_FLAG_BYTES, and -a names any alphabet but
+ * ALPHA_TEXT in V2_FLAG_ALPHABET.
+ *
+ * ****************************************************************************/
+int protoVersion = V2_VERSION;   // dropped to 1 for a daemon without v2
+int useCrc = 0;                  // -C: checksum requests and results
+
+
+
+
+/*******************************************************************************
+ * segment
+ * one message together with the matching slice of the key, sent to the
+ * daemon as a complete request: designator, 10 byte length, message, '@'
+ * sentinel, key (or a v2 header, message, key; or, multiplexed, 10 byte
+ * id, 10 byte length, message, '@', key). A segment is either a contiguous
+ * slice of a larger message (-j) or a whole file (batch mode). The reply
+ * (status or v2 header, then the result) is read back into the message
+ * bytes, which is safe because the daemon reads the whole request before it
+ * sends any result bytes, or the result is spliced straight to the output
+ * (outFD).
+ *
+ * ****************************************************************************/
+struct segment {
+	char* msg;          // first message byte of this segment
+	char* key;          // matching key bytes
+	int len;            // bytes of message (and of key) in this segment
+	char* outPath;      // batch mode: file the result goes to, else NULL
+	char header[24];    // v2 header, or designator (or id) plus length
+	int headerLen;      // bytes in header
+	int sepLen;         // 1 for the v1 '@' sentinel, 0 in v2
+	int crcLen;         // 4 when request and reply end in a CRC32C, else 0
+	uint32_t crc;       // the request's CRC32C, in network byte order
+	char replyCrc[4];   // the result's, as it arrives
+	char status[17];    // "goods" or "error" from the daemon, or v2 header
+	int statusLen;      // bytes of status: 5, or a v2 header's 16
+	int sent;           // request bytes sent so far
+	int got;            // reply bytes (status + result) read so far
+	int done;           // set once the whole result has arrived
+	int outFD;          // result is spliced here, -1 to read it into msg
+	loff_t outOff;      // offset of the result in outFD, -1 for a pipe
+};
+
+
+
+
+/*******************************************************************************
+ * connection
+ * one daemon connection of the pool. Connection c carries segments c,
+ * c + numConns, c + 2 * numConns... one after another: requests are sent
+ * back to back without waiting for replies. A plain connection gets the
+ * replies in the same order; a multiplexed one in any order.
+ *
+ * ****************************************************************************/
+struct connection {
+	int fd;             // socket to the daemon
+	int sendSeg;        // segment whose request is being sent
+	int recvSeg;        // segment whose reply is being read
+	int left;           // replies still to come
+	char status[6];     // multiplexed: the daemon's one status
+	int statusGot;      // multiplexed: status bytes read
+	char frame[21];     // multiplexed: reply frame header being read
+	int frameGot;       // multiplexed: frame header bytes read
+	int cur;            // multiplexed: segment being filled, -1 if none
+	int attempts;       // times the daemon has turned it away
+	int ep;             // the endpoint it is connected to
+	long long retryAt;  // nowMs to reconnect at, 0 while connected
+};
+
+
+
+
+
+/*******************************************************************************
+ * socket tuning
+ * -P sets TCP options on the connections to the daemon, comma separated:
+ * "latency" (TCP_NODELAY and TCP_QUICKACK), "bulk" (4MB socket buffers,
+ * TCP_CORK while a request goes out), or name=value for nodelay, cork,
+ * quickack, sndbuf and rcvbuf. Later entries win. Anything not set keeps
+ * the kernel default.
+ *
+ * ****************************************************************************/
+struct tuning {
+	int nodelay;        // TCP_NODELAY, -1 to leave alone
+	int cork;           // TCP_CORK until a request is all sent
+	int quickack;       // TCP_QUICKACK before reading replies
+	int sndbuf;         // SO_SNDBUF bytes, 0 for the kernel's
+	int rcvbuf;         // SO_RCVBUF bytes, 0 for the kernel's
+};
+
+struct tuning tune = { -1, 0, 0, 0, 0 };
+
+
+
+
+/*******************************************************************************
+ * parseTuning
+ * applies a -P specification to tune, exiting on anything unknown. Sizes
+ * take a K, M or G suffix.
+ *
+ * ****************************************************************************/
+void parseTuning(char* spec){
+	char* copy = strdup(spec);
+	char* item;
+	char* value;
+	char* end;
+	char* save;
+	long n;
+
+	for (item = strtok_r(copy, ",", &save); item != NULL;
+			item = strtok_r(NULL, ",", &save)){
+		if (strcmp(item, "latency") == 0){
+			tune.nodelay = 1;
+			tune.quickack = 1;
+			tune.cork = 0;
+			continue;
+		}
+		if (strcmp(item, "bulk") == 0){
+			tune.nodelay = 0;
+			tune.cork = 1;
+			tune.sndbuf = tune.rcvbuf = 4 << 20;
+			continue;
+		}
+
+		value = strchr(item, '=');
+		if (value == NULL)
+			goto bad;
+		*value++ = '\0';
+		n = strtol(value, &end, 10);
+		if (end == value || n < 0)
+			goto bad;
+		switch (*end){
+			case 'K': case 'k': n <<= 10; break;
+			case 'M': case 'm': n <<= 20; break;
+			case 'G': case 'g': n <<= 30; break;
+			case '\0': break;
+			default: goto bad;
+		}
+
+		if (strcmp(item, "nodelay") == 0)
+			tune.nodelay = n != 0;
+		else if (strcmp(item, "cork") == 0)
+			tune.cork = n != 0;
+		else if (strcmp(item, "quickack") == 0)
+			tune.quickack = n != 0;
+		else if (strcmp(item, "sndbuf") == 0)
+			tune.sndbuf = n;
+		else if (strcmp(item, "rcvbuf") == 0)
+			tune.rcvbuf = n;
+		else
+			goto bad;
 	}
-	// add the actual size string to the zeros
-	strcat(msgBuff, tempBuff);
+	free(copy);
+	return;
+
+bad:
+	fprintf(stderr, "Error: bad socket tuning \"%s\"\n", spec);
+	exit(1);
+}
 
 
 
-	// concatenate the ciphertext msg
-	strcat(msgBuff, cipherBuff);
 
-	// add a sentinel mostly for visual confirmation of split btwn msgs
-	strcat(msgBuff, "@");
+/*******************************************************************************
+ * setOption
+ * sets a TCP option on fd when its tuning asks for it (on >= 0).
+ *
+ * ****************************************************************************/
+void setOption(int fd, int option, int on){
+	if (on >= 0)
+		setsockopt(fd, IPPROTO_TCP, option, &on, sizeof(on));
+}
+
 
-	// concatenate the key msg in equal length of the ciphertext msg
-	strncat(msgBuff, keyBuff, strlen(cipherBuff));
-	// msgBuff should be null terminated
-	//printf("msgBuff is: ..%s..\n", msgBuff);
-	//printf("CLIENT: msgBuff id %d bytes long\n", strlen(msgBuff));
 
 
+/*******************************************************************************
+ * connectDaemon
+ * opens a connection to the daemon listening on portNumber on localhost and
+ * returns the connected socket, or -1 if nothing accepted it.
+ *
+ * ****************************************************************************/
+int connectDaemon(int portNumber){
+	int socketFD;
+	struct sockaddr_in serverAddress;
+	struct hostent* serverHostInfo;
 
- 
-	// now to send the msg
 	// Set up the server address struct
-	
 	// Clear out the address struct
 	memset((char*)&serverAddress, '\0', sizeof(serverAddress)); 
 	
@@ -271,125 +519,1431 @@ int main(int argc, char *argv[])
 		error("CLIENT: ERROR opening socket");
 	}
 
+	// buffer sizes have to be set before connecting to size the window
+	if (tune.sndbuf > 0)
+		setsockopt(socketFD, SOL_SOCKET, SO_SNDBUF, &tune.sndbuf,
+				sizeof(tune.sndbuf));
+	if (tune.rcvbuf > 0)
+		setsockopt(socketFD, SOL_SOCKET, SO_RCVBUF, &tune.rcvbuf,
+				sizeof(tune.rcvbuf));
+
 	// Connect to server
 	if (connect(socketFD, (struct sockaddr*)&serverAddress, 
-				sizeof(serverAddress)) < 0) 
-		error("CLIENT: ERROR connecting");
+				sizeof(serverAddress)) < 0){
+		close(socketFD);
+		return(-1);
+	}
 	//printf("CLIENT: connected to server\n");
+	setOption(socketFD, TCP_NODELAY, tune.nodelay);
+
+	return(socketFD);
+}
+
+
+
+
+/*******************************************************************************
+ * sendSegment
+ * sends as much of the segment's request as the socket will take without
+ * blocking. The request is gathered straight from the header, message,
+ * key and checksum buffers so nothing is copied into a staging buffer.
+ * Returns 1 once the whole request is out.
+ *
+ * ****************************************************************************/
+int sendSegment(int fd, struct segment* seg){
+	struct iovec iov[5];   // the parts of the request not yet sent
+	struct msghdr msg;
+	char* parts[5] = { seg->header, seg->msg, "@", seg->key,
+		(char*)&seg->crc };
+	int lens[5] = { seg->headerLen, seg->len, seg->sepLen, seg->len,
+		seg->crcLen };
+	int total = seg->headerLen + (2 * seg->len) + seg->sepLen + seg->crcLen;
+	int i, n = 0;
+	int skip = seg->sent;  // bytes already sent, from the front
+	int charsWritten;
+
+	// build the iovec from the unsent remainder
+	for (i = 0; i < 5; i++){
+		if (skip >= lens[i]){
+			skip -= lens[i];
+			continue;
+		}
+		iov[n].iov_base = parts[i] + skip;
+		iov[n].iov_len = lens[i] - skip;
+		skip = 0;
+		n++;
+	}
+
+	memset(&msg, 0, sizeof(msg));
+	msg.msg_iov = iov;
+	msg.msg_iovlen = n;
+
+	// when corking, the request leaves in full sized packets
+	if (tune.cork && seg->sent == 0)
+		setOption(fd, TCP_CORK, 1);
+
+	charsWritten = sendmsg(fd, &msg, MSG_NOSIGNAL);
+	if (charsWritten < 0){
+		if (errno == EAGAIN || errno == EWOULDBLOCK)
+			return(0);
+		// daemon hung up early, its status will say why
+		if (errno == EPIPE || errno == ECONNRESET){
+			seg->sent = total;
+			return(1);
+		}
+		error("CLIENT: ERROR writing to socket");
+	}
+	seg->sent += charsWritten;
+
+	if (seg->sent < total)
+		return(0);
+	if (tune.cork)
+		setOption(fd, TCP_CORK, 0);
+	return(1);
+}
+
+
+
+
+/*******************************************************************************
+ * outputTarget
+ * decides whether results can be spliced to stdout instead of passing
+ * through memory. Returns 1 if stdout is a pipe (base set to -1), or a
+ * regular file written at known offsets (base set to its current offset,
+ * with length bytes from there preallocated). Otherwise returns -1 and
+ * results are written from memory.
+ *
+ * ****************************************************************************/
+int outputTarget(long length, loff_t* base){
+	struct stat st;   // what stdout is
+
+	*base = -1;
+	if (fstat(1, &st) < 0)
+		return(-1);
+
+	// a pipe takes results in order, straight from the socket
+	if (S_ISFIFO(st.st_mode))
+		return(1);
+
+	// a file takes them at their own offsets, through splicePipe; an
+	// append only file cannot be written at an offset
+	if (!S_ISREG(st.st_mode) || (fcntl(1, F_GETFL) & O_APPEND))
+		return(-1);
+	*base = lseek(1, 0, SEEK_CUR);
+	if (*base < 0 || pipe(splicePipe) < 0){
+		*base = -1;
+		return(-1);
+	}
+	posix_fallocate(1, *base, length);
+	return(1);
+}
+
+
+
+
+/*******************************************************************************
+ * spliceResult
+ * moves the result bytes of the segment that are available from the socket
+ * to the segment's output with splice, so they never pass through user
+ * space: directly when the output is a pipe, or through splicePipe into the
+ * output file at the segment's offset. Returns the bytes moved, like recv.
+ *
+ * ****************************************************************************/
+int spliceResult(int fd, struct segment* seg){
+	int left = seg->len - (seg->got - seg->statusLen);   // still to come
+	loff_t off;                             // where they go in the file
+	int charsRead, moved, charsWritten;
+
+	if (seg->outOff < 0)
+		return(splice(fd, NULL, seg->outFD, NULL, left, SPLICE_F_MOVE));
+
+	charsRead = splice(fd, NULL, splicePipe[1], NULL, left, SPLICE_F_MOVE);
+	if (charsRead <= 0)
+		return(charsRead);
+
+	// drain the pipe into the file before anything else goes through it
+	off = seg->outOff + (seg->got - seg->statusLen);
+	for (moved = 0; moved < charsRead; moved += charsWritten){
+		charsWritten = splice(splicePipe[0], NULL, seg->outFD, &off,
+				charsRead - moved, SPLICE_F_MOVE);
+		if (charsWritten <= 0)
+			error("CLIENT: ERROR writing output");
+	}
+	return(charsRead);
+}
+
+
+
+
+/*******************************************************************************
+ * replyStatus
+ * checks the segment's reply status once statusLen bytes of it are in. Five
+ * bytes that start a v2 header are only part of it, and statusLen grows to
+ * take the rest. Returns 0 to carry on reading, -1 if the daemon is too
+ * busy and says to retry, or -2 if it does not speak the request's version
+ * and the request has to go again in v1. Exits if the daemon refuses.
+ *
+ * ****************************************************************************/
+int replyStatus(struct segment* seg, int portNumber){
+	struct v2Header hdr;
+
+	if (seg->statusLen == 5){
+		// a v2 header, read the rest of it
+		if ((unsigned char)seg->status[0] == V2_MAGIC >> 8){
+			seg->statusLen = sizeof(hdr);
+			return(0);
+		}
+		if (strcmp(seg->status, "retry") == 0)
+			return(-1);
+		if (strcmp(seg->status, "error") != 0)
+			return(0);
+
+		// a v1 daemon refuses a v2 header the same way
+		if (seg->sepLen == 0){
+			if (useCrc || binary || alphabet != ALPHA_TEXT){
+				fprintf(stderr, "Error: otp_dec_d on port %d "
+						"takes none of -C, -b and -a\n",
+						portNumber);
+				exit(1);
+			}
+			protoVersion = 1;
+			return(-2);
+		}
+		hdr.status = htons(V2_REJECTED);
+	}
+	else {
+		memcpy(&hdr, seg->status, sizeof(hdr));
+	}
+
+	switch (ntohs(hdr.status)){
+		case V2_OK:
+			if (be64toh(hdr.length) == (uint64_t)seg->len)
+				return(0);
+			fprintf(stderr, "CLIENT: bad reply header\n");
+			exit(1);
+		case V2_RETRY:
+			return(-1);
+		case V2_BAD_VERSION:
+			// v1 is the only older version
+			protoVersion = 1;
+			return(-2);
+		case V2_BAD_CHECKSUM:
+			fprintf(stderr, "Error: request to otp_dec_d on port %d failed "
+					"its checksum\n", portNumber);
+			exit(3);
+		case V2_TOO_LARGE:
+			fprintf(stderr, "Error: request too large for otp_dec_d on "
+					"port %d\n", portNumber);
+			exit(1);
+		case V2_BAD_SYMBOL:
+			fprintf(stderr, "Error: otp_dec_d on port %d found bad "
+					"characters in the request\n",
+					portNumber);
+			exit(1);
+		default:
+			// check for unallowed connection error
+			fprintf(stderr, 
+			"Error: could not contact otp_dec_d on port %d\n", portNumber);
+			exit(2);
+	}
+}
+
+
+
+
+/*******************************************************************************
+ * recvSegment
+ * reads whatever reply bytes are available for the segment. The first
+ * statusLen are the daemon's status; the rest are result bytes, stored over
+ * the segment's message bytes or spliced to its output, and then with -C
+ * the result's checksum, which it must match. Returns 1 once the
+ * whole result is in, or as replyStatus -1 if the daemon is too busy and
+ * says to retry and -2 if the request has to go again in v1. Returns -3 if
+ * the daemon went away before any of the result came, so the request can go
+ * again to another.
+ *
+ * ****************************************************************************/
+int recvSegment(int fd, struct segment* seg, int portNumber){
+	int charsRead, n;
+	uint32_t crc;    // the result's checksum
+
+	// the kernel falls back to delayed ACKs by itself, so ask again
+	if (tune.quickack)
+		setOption(fd, TCP_QUICKACK, 1);
+
+	// still reading the status
+	if (seg->got < seg->statusLen){
+		charsRead = recv(fd, seg->status + seg->got,
+				seg->statusLen - seg->got, 0);
+	}
+	else if (seg->got >= seg->statusLen + seg->len){
+		n = seg->got - seg->statusLen - seg->len;
+		charsRead = recv(fd, seg->replyCrc + n, seg->crcLen - n, 0);
+	}
+	else if (seg->outFD >= 0){
+		charsRead = spliceResult(fd, seg);
+	}
+	else {
+		charsRead = recv(fd, seg->msg + (seg->got - seg->statusLen),
+				seg->len - (seg->got - seg->statusLen), 0);
+	}
+
+	if (charsRead < 0){
+		if (errno == EAGAIN || errno == EWOULDBLOCK)
+			return(0);
+		if (errno == ECONNRESET && seg->got <= seg->statusLen)
+			return(-3);
+		error("CLIENT: ERROR reading from socket");
+	}
+	if (charsRead == 0){
+		if (seg->got <= seg->statusLen)
+			return(-3);
+		fprintf(stderr, "CLIENT: connection closed early\n");
+		exit(1);
+	}
+	seg->got += charsRead;
+
+	// the status is in, the caller backs off if the daemon is too busy
+	if (seg->got == seg->statusLen){
+		n = replyStatus(seg, portNumber);
+		if (n != 0)
+			return(n);
+	}
+
+	if (seg->got < seg->len + seg->statusLen + seg->crcLen)
+		return(0);
+
+	// a result that does not match its checksum is never written out
+	memcpy(&crc, seg->replyCrc, 4);
+	if (seg->crcLen > 0 && ntohl(crc) != crc32c(0, seg->msg, seg->len)){
+		fprintf(stderr, "Error: result from otp_dec_d on port %d failed "
+				"its checksum\n", portNumber);
+		exit(3);
+	}
+	seg->done = 1;
+
+	return(seg->done);
+}
+
+
+
+
+/*******************************************************************************
+ * writeSegment
+ * batch mode: writes a finished segment's result, newline terminated, to
+ * its own output file and releases the message buffer.
+ *
+ * ****************************************************************************/
+void writeSegment(struct segment* seg){
+	FILE* fp;
+
+	fp = fopen(seg->outPath, "w");
+	if (fp == NULL){
+		fprintf(stderr, "Error opening file: %s\n", seg->outPath);
+		exit(1);
+	}
+	fwrite(seg->msg, 1, seg->len, fp);
+	if (newline)
+		fputc('\n', fp);
+	fclose(fp);
+
+	freeBuff(seg->msg);
+	seg->msg = NULL;
+}
+
+
+
+
+/*******************************************************************************
+ * nowMs
+ * returns the monotonic clock in milliseconds.
+ *
+ * ****************************************************************************/
+long long nowMs(){
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return((long long)ts.tv_sec * 1000 + ts.tv_nsec / 1000000);
+}
+
+
+
+
+/*******************************************************************************
+ * retryDelay
+ * the daemon answered fd with "retry": reads the 10 byte wait it suggests
+ * (or takes it from a v2 status header) and returns how many milliseconds
+ * to wait before attempt number attempt to reconnect. The wait doubles with
+ * every attempt and is jittered between half and one and a half times that,
+ * so clients turned away together do not all come back together. Gives up
+ * after MAX_RETRIES attempts.
+ *
+ * ****************************************************************************/
+long retryDelay(int fd, char* status, int attempt, int portNumber){
+	struct v2Header hdr;
+	struct pollfd pfd;  // fd, for the wait to arrive
+	char number[11];    // the suggested wait
+	long ms = 100;      // used if the daemon did not say
+	long long left;     // ms until the wait is given up on
+	long long giveUp = nowMs() + RETRY_READ_MS;
+	int got, n;
+
+	if (attempt > MAX_RETRIES){
+		fprintf(stderr, "Error: otp_dec_d on port %d is busy\n",
+				portNumber);
+		exit(2);
+	}
 
-	// Send message to server, loop until all data sent
-	int totalSent = 0;        // amount of bytes sent so far
-	int toSend = msgSize;     // bytes left to send
-	while (totalSent < msgSize){
-		charsWritten = send(socketFD, (msgBuff + totalSent), toSend, 0); 
-		if (charsWritten < 0){
-		       	error("CLIENT: ERROR writing to socket");
+	// the wait is in a v2 header, or follows the status: read it whole,
+	// but not from a daemon that stalls before sending it all
+	if ((unsigned char)status[0] == V2_MAGIC >> 8){
+		memcpy(&hdr, status, sizeof(hdr));
+		ms = be64toh(hdr.length);
+	}
+	else {
+		memset(number, '\0', sizeof(number));
+		pfd.fd = fd;
+		pfd.events = POLLIN;
+		for (got = 0; got < 10; got += n){
+			n = 0;
+			left = giveUp - nowMs();
+			if (left <= 0)
+				break;
+			if (poll(&pfd, 1, left) < 0 && errno != EINTR)
+				break;
+			n = recv(fd, number + got, 10 - got, MSG_DONTWAIT);
+			if (n < 0 && (errno == EAGAIN || errno == EINTR))
+				n = 0;
+			else if (n <= 0)
+				break;
 		}
+		if (got == 10)
+			ms = atol(number);
+	}
+
+	ms <<= attempt - 1;
+	return(ms / 2 + rand() % (ms + 1));
+}
+
 
-                totalSent += charsWritten;
-		toSend -= charsWritten;
+
+
+/*******************************************************************************
+ * endpoints
+ * the daemons to use: a comma separated list of ports in place of the one
+ * port, each standing in for a separate node. A connection goes to the
+ * endpoint with the fewest requests outstanding, so the pool spreads over
+ * the endpoints and new work lands on the least loaded. An endpoint that
+ * refuses a connection is out for DOWN_MS, and one that answers busy for
+ * the wait it asks for; connections turned away move to another endpoint
+ * at once. The client only waits when every endpoint is busy, and gives up
+ * when every one is down.
+ *
+ * ****************************************************************************/
+#define MAX_ENDPOINTS 64
+#define DOWN_MS 1000         // an endpoint that refused is left this long
+
+struct endpoint {
+	int port;            // the daemon's port on localhost
+	int outstanding;     // requests sent to it whose results are not in
+	int busy;            // out because it said to retry, not because down
+	long long outUntil;  // nowMs it may be used again
+};
+
+struct endpoint endpoints[MAX_ENDPOINTS];
+int numEndpoints = 0;
+char* endpointList;          // the list as given, for messages
+
+void parseEndpoints(char* list){
+	char* next = list;
+	char* end;
+	long port;
+
+	endpointList = list;
+	while (1){
+		port = strtol(next, &end, 10);
+		if (end == next || (*end != ',' && *end != '\0') ||
+				port < 0 || port > 65535 ||
+				numEndpoints == MAX_ENDPOINTS){
+			fprintf(stderr, "Invalid port number\n");
+			exit(1);
+		}
+		endpoints[numEndpoints++].port = port;
+		if (*end == '\0')
+			break;
+		next = end + 1;
 	}
+}
 
-	//printf("CLIENT: sent %d bytes for msg\n", totalSent);
+// the endpoint in use with the fewest requests outstanding, or -1 if
+// every one is out
+int pickEndpoint(){
+	long long now = nowMs();
+	int i, best = -1;
+
+	for (i = 0; i < numEndpoints; i++){
+		if (endpoints[i].outUntil > now)
+			continue;
+		if (best < 0 || endpoints[i].outstanding <
+				endpoints[best].outstanding)
+			best = i;
+	}
+	return(best);
+}
 
+// every endpoint is out: returns the nowMs the first busy one may be tried
+// again, or exits if none is busy, as then every one is down
+long long endpointBack(){
+	long long at = 0;
+	int i;
+
+	for (i = 0; i < numEndpoints; i++){
+		if (endpoints[i].busy &&
+				(at == 0 || endpoints[i].outUntil < at))
+			at = endpoints[i].outUntil;
+	}
+	if (at == 0){
+		fprintf(stderr, "Error: could not contact otp_dec_d on "
+				"port %s\n", endpointList);
+		exit(2);
+	}
+	return(at);
+}
 
-	// wait for send buffer to clear
-	int checkSend = -5;
-	do{
-		ioctl(socketFD, TIOCOUTQ, &checkSend);
-	} while (checkSend > 0);
 
-	if (checkSend < 0)
-		error("ioctl error");
 
 
+/*******************************************************************************
+ * openConnection
+ * connects conn to the endpoint with the fewest requests outstanding,
+ * passing over any that refuse, asks for a multiplexed connection if mux is
+ * set, and makes the socket non-blocking. Returns -1, with conn->retryAt
+ * set to when to try again, if every endpoint is busy.
+ *
+ * ****************************************************************************/
+int openConnection(struct connection* conn, int mux){
+	int ep;
+
+	while ((ep = pickEndpoint()) >= 0){
+		conn->fd = connectDaemon(endpoints[ep].port);
+		if (conn->fd >= 0)
+			break;
+		endpoints[ep].outUntil = nowMs() + DOWN_MS;
+		endpoints[ep].busy = 0;
+	}
+	if (ep < 0){
+		conn->retryAt = endpointBack();
+		return(-1);
+	}
+	conn->ep = ep;
+	endpoints[ep].outstanding += conn->left;
 
-	// Get return message from server
-	// Clear out the buffer again for reuse
-	memset(cipherBuff, '\0', cipherLength); 
+	// ask for a multiplexed connection, two bytes always fit
+	if (mux && send(conn->fd, "MD", 2, 0) != 2)
+		error("CLIENT: ERROR writing to socket");
 
-	int readTotal = 0;
-	int toRead = 5;
-	while (readTotal < 5){	
-		// Read response for designator check - "D"
-		charsRead = recv(socketFD, cipherBuff, toRead, 0); 
-		
-		if (charsRead < 0) {
+	fcntl(conn->fd, F_SETFL, O_NONBLOCK);
+	conn->retryAt = 0;
+	return(0);
+}
+
+
+
+
+/*******************************************************************************
+ * setHeader
+ * writes the request header for seg, segment number id: a v2 header, the
+ * v1 designator and length, or on a multiplexed connection the id and
+ * length. A v2 request with -C also gets its CRC32C.
+ *
+ * ****************************************************************************/
+void setHeader(struct segment* seg, int id, int mux){
+	struct v2Header hdr;
+
+	seg->sepLen = 1;
+	seg->crcLen = 0;
+	if (mux){
+		sprintf(seg->header, "%010d%010d", id, seg->len);
+		seg->headerLen = 20;
+	}
+	else if (protoVersion == 1){
+		sprintf(seg->header, "%c%010d", 'D', seg->len);
+		seg->headerLen = 11;
+	}
+	else {
+		memset(&hdr, 0, sizeof(hdr));
+		hdr.magic = htons(V2_MAGIC);
+		hdr.version = V2_VERSION;
+		hdr.op = 'D';
+		hdr.length = htobe64(seg->len);
+		if (binary)
+			hdr.flags |= htons(V2_FLAG_BYTES);
+		hdr.flags |= htons(alphabet << 2);
+		if (useCrc){
+			hdr.flags |= htons(V2_FLAG_CRC);
+			seg->crc = htonl(crc32c(crc32c(0, seg->msg, seg->len),
+					seg->key, seg->len));
+			seg->crcLen = 4;
+		}
+		memcpy(seg->header, &hdr, sizeof(hdr));
+		seg->headerLen = sizeof(hdr);
+		seg->sepLen = 0;
+	}
+}
+
+
+
+
+/*******************************************************************************
+ * backOff
+ * connection c was turned away, as recvSegment says why: -1 by a busy
+ * daemon, which is then left alone for the wait from retryDelay; -2 for its
+ * version, to go again in v1; or -3 the daemon went away before the result
+ * being waited for had started. Closes it and has it reconnect at once, to
+ * the least loaded endpoint still in use. Its segments without a result
+ * are sent again: the daemon only turns a connection away before its first
+ * request, so then that is all of them.
+ *
+ * ****************************************************************************/
+void backOff(struct connection* conns, int c, struct segment* segs,
+		int numSegs, int numConns, int mux, int reason){
+	struct connection* conn = &conns[c];
+	struct endpoint* ep = &endpoints[conn->ep];
+	int i;
+
+	if (reason == -1){
+		conn->attempts++;
+		ep->outUntil = nowMs() + retryDelay(conn->fd,
+				mux ? conn->status : segs[conn->recvSeg].status,
+				conn->attempts, ep->port);
+		ep->busy = 1;
+	}
+	else if (reason == -3 && ++conn->attempts > MAX_RETRIES){
+		fprintf(stderr, "CLIENT: connection closed early\n");
+		exit(1);
+	}
+	ep->outstanding -= conn->left;
+	conn->retryAt = nowMs();
+	close(conn->fd);
+	conn->fd = -1;
+
+	for (i = conn->recvSeg; i < numSegs; i += numConns){
+		segs[i].sent = 0;
+		segs[i].got = 0;
+		segs[i].statusLen = 5;
+		setHeader(&segs[i], i, mux);
+	}
+	conn->sendSeg = conn->recvSeg;
+	conn->statusGot = 0;
+	conn->frameGot = 0;
+	conn->cur = -1;
+}
+
+
+
+
+/*******************************************************************************
+ * recvFrames
+ * multiplexed connections: reads the daemon's status and then reply frames
+ * (10 byte request id, 10 byte length, result) for as long as data is
+ * available, filling in whichever segment each frame answers. Returns how
+ * many segments were completed, or -1 if the daemon is too busy and says to
+ * retry.
+ *
+ * ****************************************************************************/
+int recvFrames(struct connection* conn, struct segment* segs, int numSegs,
+		int portNumber){
+	struct segment* seg;
+	char number[11];      // one 10 byte field of the frame header
+	int charsRead, id, len;
+	int completed = 0;
+
+	while (conn->left > 0){
+		// the status, then a frame header, then that frame's result
+		if (conn->statusGot < 5){
+			charsRead = recv(conn->fd, conn->status + conn->statusGot,
+					5 - conn->statusGot, 0);
+		}
+		else if (conn->cur < 0){
+			charsRead = recv(conn->fd, conn->frame + conn->frameGot,
+					20 - conn->frameGot, 0);
+		}
+		else {
+			seg = &segs[conn->cur];
+			charsRead = recv(conn->fd, seg->msg + seg->got,
+					seg->len - seg->got, 0);
+		}
+
+		if (charsRead < 0){
+			if (errno == EAGAIN || errno == EWOULDBLOCK)
+				break;
 			error("CLIENT: ERROR reading from socket");
 		}
-	
-		readTotal += charsRead;
-		toRead -= charsRead;
+		if (charsRead == 0){
+			fprintf(stderr, "CLIENT: connection closed early\n");
+			exit(1);
+		}
+
+		if (conn->statusGot < 5){
+			conn->statusGot += charsRead;
+			if (conn->statusGot == 5 &&
+					strcmp(conn->status, "retry") == 0)
+				return(-1);
+			// check for unallowed connection error
+			if (conn->statusGot == 5 &&
+					strcmp(conn->status, "error") == 0){
+				fprintf(stderr, "Error: could not contact otp_dec_d "
+						"on port %d\n", portNumber);
+				exit(2);
+			}
+			continue;
+		}
+
+		if (conn->cur < 0){
+			conn->frameGot += charsRead;
+			if (conn->frameGot < 20)
+				continue;
+
+			// which request this frame answers
+			memcpy(number, conn->frame, 10);
+			number[10] = '\0';
+			id = atoi(number);
+			memcpy(number, conn->frame + 10, 10);
+			len = atoi(number);
+			if (id < 0 || id >= numSegs || segs[id].done ||
+					segs[id].len != len){
+				fprintf(stderr, "CLIENT: bad reply frame\n");
+				exit(1);
+			}
+			conn->cur = id;
+			conn->frameGot = 0;
+		}
+		else {
+			segs[conn->cur].got += charsRead;
+		}
+
+		// the frame is complete once all its result bytes are in
+		seg = &segs[conn->cur];
+		if (seg->got == seg->len){
+			seg->done = 1;
+			if (seg->outPath)
+				writeSegment(seg);
+			conn->cur = -1;
+			conn->left--;
+			completed++;
+		}
 	}
-	//printf("CLIENT: I received this from the server: \"%s\"\n", cipherBuff);
-	
-	// check for unallowed connection error
-	if (strcmp(cipherBuff, "error") == 0){
-		fprintf(stderr, 
-		"Error: could not contact otp_enc_d on port %d\n", portNumber);
+
+	return(completed);
+}
+
+
+
+
+/*******************************************************************************
+ * transferSegments
+ * opens numConns connections and drives them all at once with poll, so the
+ * daemon works on every connection in parallel while each connection
+ * pipelines its share of the segments. On a multiplexed connection (mux)
+ * each request carries its segment index as an id and the daemon may answer
+ * in any order. Batch results go to their own files as they finish;
+ * otherwise results are written to stdout in segment order as soon as each
+ * one and all before it are in. With an outFD (stdout, from outputTarget)
+ * results are spliced there instead: at outBase plus the segment's place in
+ * the message for a file, or, for a pipe, by each segment in turn once the
+ * ones before it are out. Connections are spread over the endpoints, and
+ * move between them as the endpoints fail or turn them away.
+ *
+ * ****************************************************************************/
+void transferSegments(struct segment* segs, int numSegs, int numConns,
+		int mux, int outFD, loff_t outBase){
+	struct connection* conns;   // the connection pool
+	struct pollfd* fds;         // one entry per busy connection
+	int* owner;                 // connection behind each fds entry
+	struct connection* conn;
+	int i, n, got;
+	int timeout;                // poll timeout, -1 unless backing off
+	int remaining;              // connections still receiving
+	int nextOut = 0;            // next segment to write to stdout
+
+	if (numConns > numSegs)
+		numConns = numSegs;
+	remaining = numConns;
+
+	conns = calloc(numConns, sizeof(struct connection));
+	fds = calloc(numConns, sizeof(struct pollfd));
+	owner = calloc(numConns, sizeof(int));
+
+	// request headers, the frame form carries the segment index as its id
+	for (i = 0; i < numSegs; i++){
+		setHeader(&segs[i], i, mux);
+		segs[i].statusLen = 5;
+
+		// a file output takes every segment at its own offset
+		segs[i].outFD = -1;
+		segs[i].outOff = -1;
+		if (outFD >= 0 && outBase >= 0){
+			segs[i].outFD = outFD;
+			segs[i].outOff = outBase + (segs[i].msg - segs[0].msg);
+		}
+	}
+
+	// connect the whole pool up front
+	for (i = 0; i < numConns; i++){
+		conns[i].sendSeg = i;
+		conns[i].recvSeg = i;
+		conns[i].cur = -1;
+		conns[i].left = (numSegs - i + numConns - 1) / numConns;
+		openConnection(&conns[i], mux);
+	}
+
+	while (remaining > 0){
+		// a pipe output takes the next segment in order directly, as
+		// long as none of its result has been read into memory yet
+		if (outFD >= 0 && outBase < 0 && nextOut < numSegs &&
+				segs[nextOut].outFD < 0 && segs[nextOut].got <=
+				segs[nextOut].statusLen){
+			fflush(stdout);
+			segs[nextOut].outFD = outFD;
+		}
+
+		// watch every connection still waiting on replies, reconnecting
+		// the ones whose back off is over
+		n = 0;
+		timeout = -1;
+		for (i = 0; i < numConns; i++){
+			if (conns[i].left == 0)
+				continue;
+			while (conns[i].retryAt > 0){
+				got = conns[i].retryAt - nowMs();
+				if (got > 0){
+					if (timeout < 0 || got < timeout)
+						timeout = got;
+					break;
+				}
+				openConnection(&conns[i], mux);
+			}
+			if (conns[i].retryAt > 0)
+				continue;
+			fds[n].fd = conns[i].fd;
+			fds[n].events = POLLIN;
+			if (conns[i].sendSeg < numSegs)
+				fds[n].events |= POLLOUT;
+			owner[n] = i;
+			n++;
+		}
+
+		if (poll(fds, n, timeout) < 0){
+			if (errno == EINTR)
+				continue;
+			error("CLIENT: ERROR polling sockets");
+		}
+
+		for (i = 0; i < n; i++){
+			conn = &conns[owner[i]];
+
+			// keep sending requests until the socket is full
+			while ((fds[i].revents & POLLOUT) &&
+					conn->sendSeg < numSegs &&
+					sendSegment(conn->fd, &segs[conn->sendSeg]))
+				conn->sendSeg += numConns;
+
+			if (!(fds[i].revents & (POLLIN | POLLHUP | POLLERR)))
+				continue;
+
+			// and read replies until there is nothing more
+			if (mux){
+				got = recvFrames(conn, segs, numSegs,
+						endpoints[conn->ep].port);
+				if (got > 0)
+					endpoints[conn->ep].outstanding -= got;
+			}
+			else {
+				while (conn->left > 0 &&
+						(got = recvSegment(conn->fd,
+						&segs[conn->recvSeg],
+						endpoints[conn->ep].port)) > 0){
+					if (segs[conn->recvSeg].outPath)
+						writeSegment(&segs[conn->recvSeg]);
+					conn->recvSeg += numConns;
+					conn->left--;
+					endpoints[conn->ep].outstanding--;
+				}
+			}
+
+			// turned away or lost: elsewhere, later or in v1
+			if (got < 0){
+				backOff(conns, owner[i], segs, numSegs, numConns,
+						mux, got);
+				continue;
+			}
+
+			if (conn->left == 0){
+				close(conn->fd);
+				remaining--;
+			}
+		}
+
+		// write out, in order, every stdout segment that is ready
+		while (nextOut < numSegs && segs[nextOut].done){
+			if (segs[nextOut].outPath == NULL &&
+					segs[nextOut].outFD < 0)
+				fwrite(segs[nextOut].msg, 1, segs[nextOut].len,
+						stdout);
+			nextOut++;
+		}
+	}
+
+	free(conns);
+	free(fds);
+	free(owner);
+}
+
+
+
+
+/*******************************************************************************
+ * openStream
+ * returns a descriptor to read theFile from if it has to be streamed: "-"
+ * for stdin, or anything that is not a regular file, such as a pipe. Returns
+ * -1 for a regular file, which is read whole.
+ *
+ * ****************************************************************************/
+int openStream(char* theFile){
+	struct stat st;   // to tell regular files from pipes
+	int fd;
+
+	if (strcmp(theFile, "-") == 0)
+		return(0);
+
+	fd = open(theFile, O_RDONLY);
+	if (fd < 0){
+		fprintf(stderr, "Error opening file: %s\n", theFile);
+		exit(1);
+	}
+	if (fstat(fd, &st) == 0 && S_ISREG(st.st_mode)){
+		close(fd);
+		return(-1);
+	}
+	return(fd);
+}
+
+
+
+
+/*******************************************************************************
+ * streamInput
+ * sends input of unknown length (stdin or a pipe) as one streamed request:
+ * reads it in chunks of up to STREAM_CHUNK bytes, sends each as 10 byte
+ * length, message, '@', key and writes the results to stdout as they come
+ * back, each chunk using the next range of the key. A zero length chunk ends
+ * the stream. As with files the trailing newline is dropped; a newline
+ * anywhere else is a bad character.
+ *
+ * ****************************************************************************/
+void streamInput(int inFD, char* keyFile, char* keyBuff, int keyLength){
+	struct segment chunk;      // the chunk being sent
+	struct pollfd fds[2];      // the daemon, and the input while we need it
+	char* inBuff;              // input of the chunk being sent
+	char* outBuff;             // results being written out
+	char status[6];            // the daemon's reply to the designator
+	struct timespec pause;     // back off before trying again
+	int sockFD, charsRead, n, ep;
+	int attempt = 0;           // times a daemon has said it is busy
+	long long wait;            // until an endpoint may be tried again
+	int pending = 0;           // a chunk is read but not fully sent
+	int ended = 0;             // the closing zero length chunk is sent
+	int sawNewline = 0;        // input ended in a newline already
+	long keyOffset = 0;        // first key byte not yet used
+	long sentTotal = 0;        // message bytes sent
+	long recvTotal = 0;        // result bytes received
+
+	inBuff = malloc(STREAM_CHUNK + 1);
+	outBuff = malloc(STREAM_CHUNK);
+	memset(&chunk, 0, sizeof(chunk));
+	chunk.msg = inBuff;
+	chunk.headerLen = 10;
+	chunk.sepLen = 1;
+
+	// ask an endpoint for a streamed request and wait for its answer,
+	// moving on from any that refuse or are too busy, and backing off
+	// while every one is
+	while (1){
+		ep = pickEndpoint();
+		if (ep < 0){
+			wait = endpointBack() - nowMs();
+			pause.tv_sec = wait / 1000;
+			pause.tv_nsec = (wait % 1000) * 1000000L;
+			nanosleep(&pause, NULL);
+			continue;
+		}
+		sockFD = connectDaemon(endpoints[ep].port);
+		if (sockFD < 0){
+			endpoints[ep].outUntil = nowMs() + DOWN_MS;
+			endpoints[ep].busy = 0;
+			continue;
+		}
+		if (send(sockFD, "CD", 2, 0) != 2)
+			error("CLIENT: ERROR writing to socket");
+		memset(status, '\0', sizeof(status));
+		for (n = 0; n < 5; n += charsRead){
+			charsRead = recv(sockFD, status + n, 5 - n, 0);
+			if (charsRead < 0)
+				error("CLIENT: ERROR reading from socket");
+			if (charsRead == 0)
+				break;
+		}
+		if (strcmp(status, "retry") != 0)
+			break;
+
+		n = retryDelay(sockFD, status, ++attempt, endpoints[ep].port);
+		close(sockFD);
+		endpoints[ep].outUntil = nowMs() + n;
+		endpoints[ep].busy = 1;
+	}
+	if (strcmp(status, "goods") != 0){
+		fprintf(stderr, "Error: could not contact otp_dec_d on "
+				"port %d\n", endpoints[ep].port);
 		exit(2);
-	}	
-	// check if designator check was successful
-	if (strcmp(cipherBuff, "goods") == 0){
-		//printf("CLIENT: good connecton ack'd\n");
+	}
+	fcntl(sockFD, F_SETFL, O_NONBLOCK);
+
+	while (!ended || recvTotal < sentTotal){
+		// read more input only once the last chunk is on its way
+		fds[0].fd = sockFD;
+		fds[0].events = POLLIN | (pending ? POLLOUT : 0);
+		fds[1].fd = inFD;
+		fds[1].events = POLLIN;
+		n = (pending || ended) ? 1 : 2;
+
+		if (poll(fds, n, -1) < 0){
+			if (errno == EINTR)
+				continue;
+			error("CLIENT: ERROR polling sockets");
+		}
+
+		if (n == 2 && fds[1].revents){
+			charsRead = read(inFD, inBuff, STREAM_CHUNK);
+			if (charsRead < 0){
+				if (errno == EINTR)
+					continue;
+				error("CLIENT: ERROR reading input");
+			}
+
+			// only the very last input byte may be a newline
+			if (charsRead > 0 && sawNewline){
+				fprintf(stderr,
+				"otp_enc error: input contains bad characters\n");
+				exit(1);
+			}
+			if (charsRead > 0 && inBuff[charsRead - 1] == '\n'){
+				sawNewline = 1;
+				// a lone newline leaves nothing to send yet
+				if (--charsRead == 0)
+					continue;
+			}
+			checkBuff(inBuff, charsRead + 1);
+
+			if (keyOffset + charsRead > keyLength - 1){
+				fprintf(stderr, "Error: key '%s' is too short\n",
+						keyFile);
+				exit(1);
+			}
+			chunk.key = keyBuff + keyOffset;
+			chunk.len = charsRead;
+			chunk.sent = 0;
+			sprintf(chunk.header, "%010d", chunk.len);
+			keyOffset += charsRead;
+			pending = 1;
+
+			// try sending it straight away
+			fds[0].revents |= POLLOUT;
+		}
+
+		// send as much of the chunk as the socket takes
+		if (pending && (fds[0].revents & POLLOUT) &&
+				sendSegment(sockFD, &chunk)){
+			pending = 0;
+			sentTotal += chunk.len;
+			if (chunk.len == 0)
+				ended = 1;
+		}
+
+		// and pass on every result that has arrived
+		while (recvTotal < sentTotal){
+			charsRead = recv(sockFD, outBuff, STREAM_CHUNK, 0);
+			if (charsRead < 0){
+				if (errno == EAGAIN || errno == EWOULDBLOCK)
+					break;
+				error("CLIENT: ERROR reading from socket");
+			}
+			if (charsRead == 0){
+				fprintf(stderr, "CLIENT: connection closed early\n");
+				exit(1);
+			}
+			fwrite(outBuff, 1, charsRead, stdout);
+			recvTotal += charsRead;
+		}
 	}
 
+	close(sockFD);
+	if (inFD != 0)
+		close(inFD);
+	free(inBuff);
+	free(outBuff);
+}
 
 
-	// with connection verified, wait for returned cipherText
-	// reuse buffs again
-	memset(cipherBuff, '\0', cipherLength);
-	memset(keyBuff, '\0', keyLength);
-	//printf("CLIENT: cipherBuff before cipher recv: %s\n", cipherBuff);
 
-	// get the cipher text
-	readTotal = 0;              // bytes we have read so far
-	toRead = cipherLength - 1;   // amount of bytes we need to read
-	//printf("CLIENT: toRead starts at: %d\n", toRead);
-	
-	// loop until we have the whole plaintext message
-	while (readTotal < cipherLength - 1){
-		//printf("CLIENT: recv loop\n");
-		//each while loop stores what it can in keyBuff
-		charsRead = recv(socketFD, keyBuff, toRead, 0);
+
+/*******************************************************************************
+ * loadBatch
+ * reads the key offset index otp_enc -B printed, one "keyOffset length
+ * cipherFile" line per file, then reads and checks every cipher file and
+ * pairs it with its range of the key. Each result goes to outDir under the
+ * cipher file's name less its ".otp" suffix. Returns the segments and
+ * stores how many there are in numSegs.
+ *
+ * ****************************************************************************/
+struct segment* loadBatch(char* source, char* outDir, char* keyFile,
+		char* keyBuff, int keyLength, int* numSegs){
+	struct segment* segs = NULL;
+	char path[4096];    // cipher file named by one index line
+	char* name;         // file name part of the path
+	int keyOffset;      // first key byte used for this file
+	int length;         // message length recorded for this file
+	int fileLength;     // size of one cipher file
+	int cap = 0;
+	FILE* fp;
+
+	fp = fopen(source, "r");
+	if (fp == NULL){
+		fprintf(stderr, "Error opening file: %s\n", source);
+		exit(1);
+	}
+
+	*numSegs = 0;
+	while (fscanf(fp, "%d %d %4095[^\n]", &keyOffset, &length, path) == 3){
+		if (*numSegs == cap){
+			cap = cap ? cap * 2 : 64;
+			segs = realloc(segs, cap * sizeof(struct segment));
+		}
+		memset(&segs[*numSegs], 0, sizeof(struct segment));
+
+		// read the cipher file, it must hold the recorded length
+		fileLength = getSizeOf(path);
+		if (length < 0 || fileLength < length){
+			fprintf(stderr, "Error: '%s' is shorter than its index "
+					"entry\n", path);
+			exit(1);
+		}
+		segs[*numSegs].msg = allocBuff(fileLength + 1);
+		fillBuff(path, fileLength, segs[*numSegs].msg);
+		segs[*numSegs].len = length;
+		segs[*numSegs].msg[length] = '\0';
+		checkBuff(segs[*numSegs].msg, length + 1);
+
+		// use exactly the key range the file was encrypted with
+		if (keyOffset < 0 || keyOffset + length > keyLength - newline){
+			fprintf(stderr, "Error: key '%s' is too short\n", keyFile);
+			exit(1);
+		}
+		segs[*numSegs].key = keyBuff + keyOffset;
+
+		// the result goes to outDir/<name less .otp>
+		name = strrchr(path, '/');
+		name = name ? name + 1 : path;
+		segs[*numSegs].outPath = malloc(strlen(outDir) + strlen(name) + 6);
+		sprintf(segs[*numSegs].outPath, "%s/%s", outDir, name);
+		if (strlen(name) > 4 &&
+				strcmp(name + strlen(name) - 4, ".otp") == 0)
+			segs[*numSegs].outPath[strlen(segs[*numSegs].outPath) - 4] =
+				'\0';
+		else
+			strcat(segs[*numSegs].outPath, ".dec");
+
+		(*numSegs)++;
+	}
+	fclose(fp);
+
+	return(segs);
+}
+
+
+
+
+/*******************************************************************************
+ * usage
+ * prints how to run the program and exits.
+ *
+ * ****************************************************************************/
+void usage(char* progName){
+	fprintf(stderr, "USAGE: %s [-j connections] [-m] [-o outfile] ciphertext|-\n"
+		"       %*s [-P tuning] [-C] [-b] [-a alphabet]\n"
+		"       %*s key port[,port...]\n"
+		"       %s -B index [-o outdir] [-j connections] [-m]\n"
+		"       %*s [-P tuning] [-C] [-b] [-a alphabet]\n"
+		"       %*s key port[,port...]\n",
+		progName, (int)strlen(progName), "", (int)strlen(progName), "",
+		progName, (int)strlen(progName), "", (int)strlen(progName), "");
+	exit(1);
+}
+
+
+
+
+/*******************************************************************************
+ * main
+ * performs argument validation and checks the input files. Then proceeds to
+ * assemble the message to be sent for encryption. Once the message is ready
+ * main opens up a network connection to the server and sends the message to
+ * it. It then waits for the return encrypted message and once recieved, prints
+ * that encrypted message to stdout.
+ *
+ * ****************************************************************************/
+int main(int argc, char *argv[])
+{
+	int cipherLength;         // size of the ciphertext message
+	int keyLength;            // size of the enc/dec key
+	int msgLength = 0;        // message bytes to send, without newline
+	int numConns = 0;         // connections, 0 for one per endpoint
+	int mux = 0;              // -m: multiplex requests on each connection
+	int numSegs;              // segments (requests) to send
+	int segLength;            // message bytes per segment
+	int i, opt;
+	struct segment* segs = NULL;  // the segments being transferred
+	int inFD = -1;            // input to stream, -1 for a regular file
+	char* cipherBuff = NULL;  // the whole ciphertext message
+	char* textFile = NULL;    // ciphertext file (single message mode)
+	char* keyFile;            // key file
+	char* batchSource = NULL; // -B: key offset index from otp_enc -B
+	char* outPath = NULL;     // -o: batch output directory, or output file
+	int outFD = -1;           // results are spliced here, -1 if not
+	loff_t outBase = -1;      // offset of the result in an output file
+	int fd, skip = 0;
+	char* keyBuff;            // the key, or just the message's range of it
+	long keyOffset = -1;      // pad offset of that range, -1 for whole key
+    
+	initAlphabets();
+
+	// Check usage & args
+	while ((opt = getopt(argc, argv, "j:B:o:mP:Cba:")) != -1){
+		switch (opt){
+			// -j connections: spread the work over this many
+			case 'j':
+				numConns = atoi(optarg);
+				break;
+			// -B index: batch mode
+			case 'B':
+				batchSource = optarg;
+				break;
+			// -o dir|file: batch output directory, or output file
+			case 'o':
+				outPath = optarg;
+				break;
+			// -m: multiplexed requests, answered out of order
+			case 'm':
+				mux = 1;
+				break;
+			// -P tuning: TCP options, a profile and/or name=value
+			case 'P':
+				parseTuning(optarg);
+				break;
+			// -C: CRC32C on every request and result
+			case 'C':
+				useCrc = 1;
+				break;
+			// -b: binary data and pad, XORed
+			case 'b':
+				binary = 1;
+				newline = 0;
+				break;
+			// -a: the alphabet messages and keys are written in
+			case 'a':
+				alphabet = findAlphabet(optarg);
+				if (alphabet < 0)
+					usage(argv[0]);
+				break;
+			default:
+				usage(argv[0]);
+		}
+	}
+	if (argc - optind != (batchSource ? 2 : 3)) { 
+		usage(argv[0]);
+	} 
+
+	// name the positional arguments
+	if (batchSource == NULL)
+		textFile = argv[optind++];
+	keyFile = argv[optind++];
 	
-		if (charsRead < 0) {	
-			error("CLIENT: Error reading cipher from socket");
+	// Get and validate the port numbers, one or a list of endpoints
+	parseEndpoints(argv[optind]);
+	if (numConns < 1)
+		numConns = numEndpoints;
+
+	// jitter for backing off from a busy daemon
+	srand(time(NULL) ^ getpid());
+
+	// get the size of the key text file
+	keyLength = getSizeOf(keyFile);
+	//printf("keyText is %d bytes long\n", keyLength);
+
+	// -o names the output file of a single message, it becomes stdout
+	if (batchSource == NULL && outPath != NULL){
+		fd = open(outPath, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+		if (fd < 0){
+			fprintf(stderr, "Error opening file: %s\n", outPath);
+			exit(1);
+		}
+		dup2(fd, 1);
+		close(fd);
+	}
+
+	// stdin ("-") and pipes have no size up front, they are streamed
+	if (batchSource == NULL)
+		inFD = openStream(textFile);
+
+	// checksums, binary pads and alphabets ride on v2 requests, which
+	// multiplexed and streamed connections do not use
+	if ((useCrc || binary || alphabet != ALPHA_TEXT) &&
+			(mux || inFD >= 0)){
+		fprintf(stderr, "Error: -C, -b and -a cannot be used with -m "
+				"or streamed input\n");
+		exit(1);
+	}
+	if (binary && alphabet != ALPHA_TEXT){
+		fprintf(stderr, "Error: -a cannot be used with -b\n");
+		exit(1);
+	}
+
+	if (batchSource == NULL && inFD < 0){
+		// get the size of the cipher text file
+		cipherLength = getSizeOf(textFile);
+
+		// meke a buffer so we can read cipherText into it
+		cipherBuff = allocBuff(cipherLength + 1);
+
+		// fill the buffer with the ciphertext file contents
+		fillBuff(textFile, cipherLength, cipherBuff);
+
+		// otp_enc -k starts the ciphertext with the key offset, drop it
+		// (never on a binary ciphertext, which may start with digits)
+		if (!binary)
+			skip = keyPrefix(cipherBuff, cipherLength, &keyOffset);
+		memmove(cipherBuff, cipherBuff + skip, cipherLength - skip);
+		cipherLength -= skip;
+
+		// check if key text is at least as long as the cipher text
+		if (keyOffset < 0 && keyLength < cipherLength){
+			fprintf(stderr, "Error: key '%s' is too short\n", keyFile);
+			exit(1);
 		}
-		
-		// the msg segment in keyBuff is concatenated to cipherBuff
-		strcat(cipherBuff, keyBuff);
-		// reset keyBuff again
-		memset(keyBuff, '\0', keyLength);
+	
+		// an empty file is an empty message
+		if (cipherLength < newline)
+			cipherLength = newline;
+
+		// remove trailing newline from buffer
+		if (newline)
+			cipherBuff[cipherLength - 1] = '\0';
+	
+		// check that the buffer contains valid characters " " or "A - Z"
+		checkBuff(cipherBuff, cipherLength);
+		msgLength = cipherLength - newline;
+	}
+
+	if (keyOffset >= 0){
+		// only the message's own range of the pad is read
+		keyBuff = allocBuff(msgLength + 1);
+		fillKeyRange(keyFile, keyLength, keyOffset, msgLength, keyBuff);
+	}
+	else {
+		// meke a buffer so we can read keyText into it
+		keyBuff = allocBuff(keyLength);
+
+		// fill that buffer with the keytext file contents
+		fillBuff(keyFile, keyLength, keyBuff);
+		//printf("keyBuff: ..%s..\n", keyBuff);
+	
+		// remove trailing newline from buffer
+		if (newline)
+			keyBuff[keyLength - 1] = '\0';
+	
+		// check that the buffer contains valid characters " " or "A - Z"
+		checkBuff(keyBuff, keyLength);
+	}
 
-		readTotal += charsRead;
-		toRead -= charsRead;
-		//printf("charsRead: %d\n", charsRead);
-		//printf("readTotal: %d\n",readTotal );
-		//printf("toRead: %d\n", toRead);
+
+	if (inFD >= 0){
+		// input of unknown length, streamed over one connection
+		streamInput(inFD, keyFile, keyBuff, keyLength);
+		numSegs = 0;
+	}
+	else if (batchSource != NULL){
+		// one segment per file, pipelined over the connection pool
+		segs = loadBatch(batchSource, outPath ? outPath : ".", keyFile,
+				keyBuff, keyLength, &numSegs);
+	}
+	else {
+		// split the message into numConns contiguous segments, each
+		// paired with the same range of the key
+		numSegs = numConns;
+		if (numSegs > msgLength)
+			numSegs = msgLength;
+		if (numSegs < 1)
+			numSegs = 1;
+		segs = calloc(numSegs, sizeof(struct segment));
+		segLength = msgLength / numSegs;
+		for (i = 0; i < numSegs; i++){
+			segs[i].msg = cipherBuff + (i * segLength);
+			segs[i].key = keyBuff + (i * segLength);
+			segs[i].len = segLength;
+		}
+		// the last segment also takes the remainder
+		segs[numSegs - 1].len = msgLength - ((numSegs - 1) * segLength);
+
+		// multiplexed, the daemon works on every segment at once over
+		// a single connection
+		if (mux)
+			numConns = 1;
+
+		// splice the result, newline included, to the output if it can
+		// take it; multiplexed replies are framed, and checksummed ones
+		// checked, in memory
+		if (!mux && !useCrc)
+			outFD = outputTarget(msgLength + newline, &outBase);
 	}
 
-	//printf("CLIENT: plain text is %d bytes\n", strlen(cipherBuff));
-	// print the plain text to stdout
-	printf("%s\n", cipherBuff);
+	// send every segment and deliver the results as they come back
+	if (numSegs > 0)
+		transferSegments(segs, numSegs, numConns, mux, outFD, outBase);
 
-	// Close the socket
-	close(socketFD); 
+	// an output file gets its newline at the end of the result, and is
+	// left positioned after it
+	if (outBase >= 0){
+		if (newline && pwrite(1, "\n", 1, outBase + msgLength) != 1)
+			error("CLIENT: ERROR writing output");
+		lseek(1, outBase + msgLength + newline, SEEK_SET);
+	}
+	else if (batchSource == NULL && newline)
+		printf("\n");
 
 
 
 	// cleanup
 	if (cipherBuff){
-		free(cipherBuff);
+		freeBuff(cipherBuff);
 	}
 	if (keyBuff){
-		free(keyBuff);
-	}
-	if (msgBuff){
-		free(msgBuff);
+		freeBuff(keyBuff);
 	}
-	if (tempBuff){
-		free(tempBuff);
+	if (segs){
+		for (i = 0; i < numSegs; i++){
+			if (segs[i].outPath)
+				free(segs[i].outPath);
+		}
+		free(segs);
 	}
 
 
@@ -2,7 +2,11 @@
  * otp_dec_d.c
  * Parker Howell
  * 12-1-17
- * Usage: otp_dec_d <serverport> &
+ * Usage: otp_dec_d [-t tracefile] [-m threads] [-c chunk] [-M budget]
+ *        [-w workers] [-r ms] [-T hs:hdr:rate] [-a cpus] [-A cpus | -N nodes]
+ *        [-Z bytes] [-P tuning] [-f fd] <serverport> &
+ *        (the port may be left out when a listening socket is handed over
+ *        with -f/--fd or LISTEN_FDS)
  * Description - Attempts to open a server daemon on serverport. If successful
  * will listen for and accept up to 5 connectins at a time. Each connection will
  * be forked off to its own child process. Each child process will listen
@@ -14,132 +18,2677 @@
  * ****************************************************************************/
 
 
+#define _GNU_SOURCE     // CPU affinity
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <stdint.h>
+#include <limits.h>
+#include <endian.h>
 #include <unistd.h>
 #include <sys/types.h> 
 #include <sys/socket.h>
 #include <netinet/in.h>
+#include <netinet/tcp.h>
 #include <signal.h>
 #include <sys/ioctl.h>
+#include <sys/wait.h>
+#include <sys/mman.h>
+#include <time.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <pthread.h>
+#include <poll.h>
+#include <sys/select.h>
+#include <getopt.h>
+#include <sched.h>
+#include <sys/syscall.h>
+#include <linux/errqueue.h>
+#include <linux/futex.h>
+
+#include "alphabets.h"
+#include "protocol.h"
 
 
 
 // global array and count to track child processes
-pid_t pidArray[6];  // hold unreaped child process id's
-int pidCount = 0;   // track how many child PID's in pidArray
+pid_t* pidArray = NULL;  // hold unreaped child process id's
+int pidCount = 0;        // track how many child PID's in pidArray
+int pidCap = 0;          // how many PID's pidArray has room for
+
+
+
+// Error function used for reporting issues
+void error(const char *msg) { 
+	perror(msg); 
+	exit(1); 
+}
+
+
+
+
+/*******************************************************************************
+ * daemon statistics
+ * counters and histograms kept in an anonymous shared mapping so the parent
+ * and every forked child update the same values. Updates are relaxed atomic
+ * adds, one per event or per request (never per byte), so they cost next to
+ * nothing on the request path. Histograms use power of two buckets: bucket i
+ * counts values v with 2^(i-1) < v <= 2^i.
+ *
+ * ****************************************************************************/
+#define HIST_BUCKETS 32
+
+// timed phases of a single request
+enum { PH_QUEUE, PH_HANDSHAKE, PH_HEADER, PH_PAYLOAD, PH_KEY, PH_CIPHER,
+	PH_SEND, PH_DRAIN, PH_COUNT };
+const char* phaseNames[PH_COUNT] = { "queue", "handshake", "header",
+	"payload", "key", "cipher", "send", "drain" };
+
+struct daemonStats {
+	unsigned long connAccepted;    // connections returned by accept
+	unsigned long connRejected;    // connections refused with "error"
+	unsigned long connBusy;        // connections turned away with "retry"
+	unsigned long handshakeFails;  // bad or missing designator
+	long activeWorkers;            // children currently serving a client
+	unsigned long requests;        // requests fully served
+	unsigned long bytesIn;         // payload + key bytes received
+	unsigned long bytesOut;        // result bytes sent
+	unsigned long sizeHist[HIST_BUCKETS];   // request size in bytes
+	unsigned long sizeSum;
+	unsigned long phaseHist[PH_COUNT][HIST_BUCKETS];  // phase time in usec
+	unsigned long phaseSum[PH_COUNT];                 // phase time in nsec
+	unsigned long tracesDropped;   // trace lines the writer could not write
+	unsigned long memReserved;     // request buffer bytes held by workers
+	unsigned long memWaits;        // reservations that waited for memory
+	unsigned int memReleases;      // futex word, bumped as memory returns
+	unsigned int memSleepers;      // workers asleep on memReleases
+	unsigned long timeouts;        // clients cut off for missing a deadline
+	unsigned long zeroCopySends;   // results sent with MSG_ZEROCOPY
+	unsigned long zeroCopyCopied;  // connections where the kernel copied
+	unsigned long checksumErrors;  // requests that failed their CRC32C
+	unsigned long symbolErrors;    // requests not in their alphabet
+};
+
+struct daemonStats* stats;   // points into the shared mapping
+
+#define STAT_ADD(field, n) \
+	__atomic_fetch_add(&stats->field, (n), __ATOMIC_RELAXED)
+
+
+
+
+/*******************************************************************************
+ * memWake
+ * wakes every worker waiting in reserveMem, in any process, to look at the
+ * budget again: when memory is returned, and when they are asked to finish
+ * up. The word changes first, so a worker about to sleep on the old value
+ * does not.
+ *
+ * ****************************************************************************/
+void memWake(){
+	__atomic_add_fetch(&stats->memReleases, 1, __ATOMIC_SEQ_CST);
+	if (__atomic_load_n(&stats->memSleepers, __ATOMIC_SEQ_CST) > 0)
+		syscall(SYS_futex, &stats->memReleases, FUTEX_WAKE, INT_MAX,
+				NULL, NULL, 0);
+}
+
+
+
+/*******************************************************************************
+ * request tracing
+ * when started with -t, each child fills in a trace record for the request it
+ * is serving and appends one JSON line per request to a small buffer. The
+ * buffer is written to the trace file (or FIFO) with a single non-blocking
+ * write when it fills or the child exits; a full pipe drops the lines and
+ * counts them instead of stalling the request. Worker threads of a
+ * multiplexed connection share the buffer under traceLock.
+ *
+ * ****************************************************************************/
+// one write of at most PIPE_BUF bytes is atomic, so children never interleave
+#define TRACE_BUFF_SIZE 4096
+
+struct reqTrace {
+	long long startNs;            // realtime clock when the request began
+	long long phaseNs[PH_COUNT];  // time spent in each phase, -1 if skipped
+	int size;                     // message length
+	const char* status;           // "goods", "error", "busy", "timeout"
+	                              // or "checksum"
+};
+
+int traceFD = -1;                  // trace destination, -1 when disabled
+char traceBuff[TRACE_BUFF_SIZE];   // pending trace lines
+int traceLen = 0;                  // bytes used in traceBuff
+pthread_mutex_t traceLock = PTHREAD_MUTEX_INITIALIZER;  // guards traceBuff
+struct reqTrace trace;             // record for the current request
+long long acceptNs;                // realtime clock when accept returned
+long long phaseMark;               // monotonic stamp the current phase began
+
+
+
+
+/*******************************************************************************
+ * initStats
+ * maps the shared, zero filled, statistics block. Must be called before the
+ * first fork so every child inherits the same mapping.
+ *
+ * ****************************************************************************/
+void initStats(){
+	stats = mmap(NULL, sizeof(struct daemonStats), PROT_READ | PROT_WRITE,
+			MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+	if (stats == MAP_FAILED)
+		error("ERROR mapping stats");
+}
+
+
+
+
+/*******************************************************************************
+ * nowNs
+ * returns the monotonic clock in nanoseconds.
+ *
+ * ****************************************************************************/
+long long nowNs(){
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (long long)ts.tv_sec * 1000000000LL + ts.tv_nsec;
+}
+
+
+
+
+/*******************************************************************************
+ * histBucket
+ * returns the histogram bucket for value v, ceil(log2(v)) clamped to the
+ * last bucket.
+ *
+ * ****************************************************************************/
+int histBucket(unsigned long v){
+	int b;
+
+	if (v <= 1)
+		return 0;
+	b = 64 - __builtin_clzl(v - 1);
+	if (b >= HIST_BUCKETS)
+		b = HIST_BUCKETS - 1;
+	return b;
+}
+
+
+
+
+/*******************************************************************************
+ * recordPhase
+ * adds one observation of phase taking ns nanoseconds to the histograms.
+ *
+ * ****************************************************************************/
+void recordPhase(int phase, long long ns){
+	if (ns < 0)
+		ns = 0;
+	STAT_ADD(phaseHist[phase][histBucket(ns / 1000)], 1);
+	STAT_ADD(phaseSum[phase], ns);
+}
+
+
+
+
+/*******************************************************************************
+ * observePhase
+ * records that phase of the current request took ns nanoseconds.
+ *
+ * ****************************************************************************/
+void observePhase(int phase, long long ns){
+	recordPhase(phase, ns);
+	trace.phaseNs[phase] = ns < 0 ? 0 : ns;
+}
+
+
+
+
+/*******************************************************************************
+ * markPhase
+ * ends the phase that began at phaseMark, records it, and starts the next.
+ *
+ * ****************************************************************************/
+void markPhase(int phase){
+	long long now = nowNs();
+
+	observePhase(phase, now - phaseMark);
+	phaseMark = now;
+}
+
+
+
+
+/*******************************************************************************
+ * accumulatePhase
+ * like markPhase, but adds to the time already traced for phase, for phases
+ * a request goes through more than once (the chunks of a stream).
+ *
+ * ****************************************************************************/
+void accumulatePhase(int phase){
+	long long now = nowNs();
+
+	recordPhase(phase, now - phaseMark);
+	if (trace.phaseNs[phase] < 0)
+		trace.phaseNs[phase] = 0;
+	trace.phaseNs[phase] += now - phaseMark;
+	phaseMark = now;
+}
+
+
+
+
+/*******************************************************************************
+ * openTrace
+ * opens the trace destination for appending without blocking. A FIFO must
+ * already have a reader attached.
+ *
+ * ****************************************************************************/
+void openTrace(const char* path){
+	traceFD = open(path, O_WRONLY | O_CREAT | O_APPEND | O_NONBLOCK |
+			O_CLOEXEC, 0644);
+	if (traceFD < 0)
+		error("ERROR opening trace file");
+}
+
+
+
+
+/*******************************************************************************
+ * writeTrace
+ * hands the buffered trace lines to the kernel in one write. If the write
+ * would block or comes up short the lines are dropped and counted. The
+ * caller holds traceLock.
+ *
+ * ****************************************************************************/
+void writeTrace(){
+	int written;
+	int i, lines = 0;
+
+	if (traceFD < 0 || traceLen == 0)
+		return;
+
+	written = write(traceFD, traceBuff, traceLen);
+	if (written != traceLen){
+		for (i = 0; i < traceLen; i++){
+			if (traceBuff[i] == '\n')
+				lines++;
+		}
+		STAT_ADD(tracesDropped, lines);
+	}
+	traceLen = 0;
+}
+
+
+
+
+/*******************************************************************************
+ * flushTrace
+ * writes out whatever trace lines are buffered.
+ *
+ * ****************************************************************************/
+void flushTrace(){
+	pthread_mutex_lock(&traceLock);
+	writeTrace();
+	pthread_mutex_unlock(&traceLock);
+}
+
+
+
+
+/*******************************************************************************
+ * resetTrace
+ * clears a trace record for the next request.
+ *
+ * ****************************************************************************/
+void resetTrace(struct reqTrace* tr){
+	int i;
+
+	for (i = 0; i < PH_COUNT; i++)
+		tr->phaseNs[i] = -1;
+	tr->size = 0;
+	tr->status = NULL;
+}
+
+
+
+
+/*******************************************************************************
+ * emitTrace
+ * formats a trace record as one JSON line into the trace buffer, flushing
+ * first if the line would not fit, then resets the record.
+ *
+ * ****************************************************************************/
+void emitTrace(struct reqTrace* tr){
+	char line[512];   // the formatted record
+	int len, i;
+	long long total = 0;
+
+	if (traceFD < 0)
+		return;
+
+	len = snprintf(line, sizeof(line),
+		"{\"ts\":%lld,\"pid\":%d,\"op\":\"D\",\"status\":\"%s\","
+		"\"size\":%d", tr->startNs, (int)getpid(),
+		tr->status ? tr->status : "error", tr->size);
+	for (i = 0; i < PH_COUNT; i++){
+		if (tr->phaseNs[i] < 0)
+			continue;
+		len += snprintf(line + len, sizeof(line) - len, ",\"%s_ns\":%lld",
+				phaseNames[i], tr->phaseNs[i]);
+		total += tr->phaseNs[i];
+	}
+	len += snprintf(line + len, sizeof(line) - len, ",\"total_ns\":%lld}\n",
+			total);
+
+	pthread_mutex_lock(&traceLock);
+	if (traceLen + len > TRACE_BUFF_SIZE)
+		writeTrace();
+	memcpy(traceBuff + traceLen, line, len);
+	traceLen += len;
+	pthread_mutex_unlock(&traceLock);
+
+	resetTrace(tr);
+}
+
+
+
+
+/*******************************************************************************
+ * deadlines
+ * a worker never waits on its client without a deadline. The client has
+ * handshakeMs to send its designator (also the idle limit between requests
+ * on a kept alive connection and between frames of a multiplexed one),
+ * headerMs after "goods" to send the length, and then has to send message
+ * and key at minRate bytes a second or better. The rate is kept over a
+ * sliding window rather than the whole length the client claimed: the
+ * first RATE_WINDOW_MS worth of bytes at minRate is due within headerMs of
+ * grace plus that time, and each window after it within RATE_WINDOW_MS of
+ * the one before, so a client cannot claim a huge length and then trickle.
+ * A client that misses a deadline is cut off and its worker exits,
+ * releasing its slot and memory; an idle connection is simply closed. 0
+ * turns a deadline off. Waits use poll with the time left rather than a
+ * blocking recv. Sends are held to the same rule the other way, window by
+ * window as the kernel takes the bytes, and once a send is handed over the
+ * client has headerMs plus what is still queued at minRate to take it,
+ * which also bounds the wait for the send buffer to drain before closing.
+ *
+ * ****************************************************************************/
+#define RATE_WINDOW_MS 5000  // minRate is kept over windows this long
+
+int handshakeMs = 30000;     // designator, and idle time between requests
+int headerMs = 30000;        // length after "goods"
+long minRate = 16384;        // slowest message and key transfer, bytes/sec
+long long deadline = 0;      // nowNs the current wait must end by, 0 if none
+long long sendDeadline = 0;  // nowNs the client must have taken the last
+                             // send by, 0 if none
+unsigned long recvWindow = 0;   // payload bytes a window, 0 outside one
+unsigned long recvWindowGot = 0;   // bytes received in this window
+unsigned long sendWindowGot = 0;   // bytes sent in this window
+int idleWait = 0;            // missing the deadline now just closes
+volatile sig_atomic_t draining = 0;   // close rather than wait for more
+
+
+
+
+/*******************************************************************************
+ * setDeadline
+ * starts a deadline ms from now for what the worker is about to read; idle
+ * says nothing has been asked of the client yet, so running out of time is
+ * a clean close rather than a timeout.
+ *
+ * ****************************************************************************/
+void setDeadline(long long ms, int idle){
+	deadline = ms > 0 ? nowNs() + ms * 1000000LL : 0;
+	idleWait = idle;
+	recvWindow = 0;
+}
+
+
+
+
+/*******************************************************************************
+ * rateWindow
+ * the bytes a client must move in each window, RATE_WINDOW_MS at minRate.
+ *
+ * ****************************************************************************/
+unsigned long rateWindow(){
+	return((unsigned long)minRate * RATE_WINDOW_MS / 1000);
+}
+
+
+
+
+/*******************************************************************************
+ * setPayloadDeadline
+ * starts the deadline for receiving bytes of message and key at minRate:
+ * headerMs of grace plus the first window, or all of bytes if they take
+ * less. recvProgress moves it on as the bytes come in.
+ *
+ * ****************************************************************************/
+void setPayloadDeadline(unsigned long bytes){
+	if (minRate <= 0){
+		setDeadline(0, 0);
+		return;
+	}
+	if (bytes > rateWindow())
+		bytes = rateWindow();
+	setDeadline(headerMs + bytes * 1000 / minRate, 0);
+	recvWindow = rateWindow();
+	recvWindowGot = 0;
+}
+
+
+
+
+/*******************************************************************************
+ * recvProgress
+ * counts n payload bytes received; each full window starts the next, due
+ * RATE_WINDOW_MS from now.
+ *
+ * ****************************************************************************/
+void recvProgress(int n){
+	if (recvWindow == 0 || n <= 0)
+		return;
+	recvWindowGot += n;
+	if (recvWindowGot < recvWindow)
+		return;
+	recvWindowGot %= recvWindow;
+	deadline = nowNs() + RATE_WINDOW_MS * 1000000LL;
+}
+
+
+
+
+/*******************************************************************************
+ * setSendDeadline
+ * starts the deadline for the client to take a send of bytes: headerMs
+ * plus the bytes at minRate, at most a window of them; sendProgress moves
+ * it on. Shared by a multiplexed connection's threads, which send one at
+ * a time.
+ *
+ * ****************************************************************************/
+void setSendDeadline(unsigned long bytes){
+	long long ms;
+
+	if (bytes > rateWindow())
+		bytes = rateWindow();
+	ms = minRate > 0 ? headerMs + bytes * 1000 / minRate : 0;
+	__atomic_store_n(&sendDeadline, ms > 0 ? nowNs() + ms * 1000000LL : 0,
+			__ATOMIC_RELAXED);
+	sendWindowGot = 0;
+}
+
+
+
+
+/*******************************************************************************
+ * sendProgress
+ * counts n bytes the kernel took from a send; each full window starts the
+ * next, due RATE_WINDOW_MS from now.
+ *
+ * ****************************************************************************/
+void sendProgress(int n){
+	if (minRate <= 0 || n <= 0)
+		return;
+	sendWindowGot += n;
+	if (sendWindowGot < rateWindow())
+		return;
+	sendWindowGot %= rateWindow();
+	__atomic_store_n(&sendDeadline, nowNs() + RATE_WINDOW_MS * 1000000LL,
+			__ATOMIC_RELAXED);
+}
+
+
+
+
+/*******************************************************************************
+ * sendHandedOver
+ * once a send is all with the kernel, gives the client headerMs plus what
+ * is still queued at minRate to take it.
+ *
+ * ****************************************************************************/
+void sendHandedOver(int connFD){
+	int queued = 0;   // bytes not yet acknowledged
+
+	if (minRate <= 0)
+		return;
+	ioctl(connFD, TIOCOUTQ, &queued);
+	__atomic_store_n(&sendDeadline, nowNs() + (headerMs +
+			(long long)queued * 1000 / minRate) * 1000000LL,
+			__ATOMIC_RELAXED);
+}
+
+
+
+
+/*******************************************************************************
+ * sendTimeLeft
+ * milliseconds left before the send deadline, as a poll timeout: -1 if
+ * there is none, 0 once it has passed.
+ *
+ * ****************************************************************************/
+int sendTimeLeft(){
+	long long until = __atomic_load_n(&sendDeadline, __ATOMIC_RELAXED);
+	long long left;
+
+	if (until == 0)
+		return(-1);
+	left = until - nowNs();
+	return(left > 0 ? (int)((left + 999999) / 1000000) : 0);
+}
+
+
+
+
+/*******************************************************************************
+ * waitWritable
+ * waits until connFD has room to send or the send deadline passes. Returns
+ * 0 when it can be written, -1 once time has run out.
+ *
+ * ****************************************************************************/
+int waitWritable(int connFD){
+	struct pollfd pfd;    // the connection
+	int left, ready;
+
+	pfd.fd = connFD;
+	pfd.events = POLLOUT;
+	do {
+		left = sendTimeLeft();
+		if (left == 0)
+			return(-1);
+		ready = poll(&pfd, 1, left);
+	} while (ready < 0 && errno == EINTR);
+
+	if (ready < 0)
+		error("ERROR polling socket");
+	return(ready > 0 ? 0 : -1);
+}
+
+
+
+
+/*******************************************************************************
+ * waitReadable
+ * waits until connFD has data or the deadline passes. Returns 0 when it is
+ * readable (or there is no deadline), -1 once time has run out, or at once
+ * for an idle wait when the worker has been asked to finish up.
+ *
+ * ****************************************************************************/
+int waitReadable(int connFD){
+	struct pollfd pfd;    // the connection
+	long long left;       // nanoseconds until the deadline
+	int ready;
+
+	if (deadline == 0 && !idleWait)
+		return(0);
+
+	pfd.fd = connFD;
+	pfd.events = POLLIN;
+	do {
+		if (draining && idleWait)
+			return(-1);
+		left = deadline - nowNs();
+		if (deadline != 0 && left <= 0)
+			return(-1);
+		ready = poll(&pfd, 1, deadline == 0 ? -1 :
+				(int)((left + 999999) / 1000000));
+	} while (ready < 0 && errno == EINTR);
+
+	if (ready < 0)
+		error("ERROR polling socket");
+	return(ready > 0 ? 0 : -1);
+}
+
+
+
+
+/*******************************************************************************
+ * timedOut
+ * cuts off a client that missed its deadline: counts and traces it, then
+ * ends the worker.
+ *
+ * ****************************************************************************/
+void timedOut(){
+	STAT_ADD(timeouts, 1);
+	trace.status = "timeout";
+	emitTrace(&trace);
+	exit(1);
+}
+
+
+
+
+/*******************************************************************************
+ * recvTimed
+ * recv for a client that has a deadline: cuts it off if no data comes in
+ * time.
+ *
+ * ****************************************************************************/
+int recvTimed(int connFD, char* buff, int len){
+	int charsRead;
+
+	if (waitReadable(connFD) < 0)
+		timedOut();
+	charsRead = recv(connFD, buff, len, 0);
+	recvProgress(charsRead);
+	return(charsRead);
+}
+
+
+
+
+/*******************************************************************************
+ * recvFirst
+ * reads the one byte designator. When tracing, the listening socket has
+ * SO_TIMESTAMPNS set (and accepted sockets inherit it), so the kernel reports
+ * when that byte arrived. For the first request on a connection the gap
+ * until accept returned is the time the connection sat in the accept queue.
+ *
+ * ****************************************************************************/
+int recvFirst(int connFD, char* buffer, int firstRequest){
+	struct msghdr msg;
+	struct iovec iov;
+	struct cmsghdr* cmsg;
+	struct timespec* stamp;
+	char control[CMSG_SPACE(sizeof(struct timespec))];
+	int charsRead;
+
+	// no designator in time: a new connection is cut off, a kept alive
+	// one is only idle and is closed as if the client had hung up
+	if (waitReadable(connFD) < 0){
+		if (firstRequest)
+			timedOut();
+		return(0);
+	}
+
+	memset(&msg, 0, sizeof(msg));
+	iov.iov_base = buffer;
+	iov.iov_len = 1;
+	msg.msg_iov = &iov;
+	msg.msg_iovlen = 1;
+	msg.msg_control = control;
+	msg.msg_controllen = sizeof(control);
+
+	charsRead = recvmsg(connFD, &msg, 0);
+	if (charsRead <= 0 || traceFD < 0 || !firstRequest)
+		return charsRead;
+
+	for (cmsg = CMSG_FIRSTHDR(&msg); cmsg; cmsg = CMSG_NXTHDR(&msg, cmsg)){
+		if (cmsg->cmsg_level == SOL_SOCKET &&
+				cmsg->cmsg_type == SCM_TIMESTAMPNS){
+			stamp = (struct timespec*)CMSG_DATA(cmsg);
+			observePhase(PH_QUEUE, acceptNs -
+				((long long)stamp->tv_sec * 1000000000LL +
+				 stamp->tv_nsec));
+		}
+	}
+	return charsRead;
+}
+
+
+
+
+/*******************************************************************************
+ * workerDone
+ * atexit hook for children so the active worker gauge drops however the
+ * child exits.
+ *
+ * ****************************************************************************/
+void workerDone(){
+	STAT_ADD(activeWorkers, -1);
+}
+
+
+
+
+/*******************************************************************************
+ * writeHist
+ * prints one histogram in Prometheus text format. Buckets are stored as
+ * plain counts and made cumulative here. scale converts a bucket bound into
+ * the exported unit.
+ *
+ * ****************************************************************************/
+void writeHist(FILE* out, const char* name, const char* label,
+		unsigned long* hist, double sum, double scale){
+	int i;
+	unsigned long cum = 0;       // running cumulative bucket count
+	const char* sep = label[0] ? "," : "";
+
+	for (i = 0; i < HIST_BUCKETS; i++){
+		cum += __atomic_load_n(&hist[i], __ATOMIC_RELAXED);
+		fprintf(out, "%s_bucket{%s%sle=\"%g\"} %lu\n", name, label, sep,
+				(double)(1UL << i) * scale, cum);
+	}
+	fprintf(out, "%s_bucket{%s%sle=\"+Inf\"} %lu\n", name, label, sep, cum);
+	fprintf(out, "%s_sum%s%s%s %g\n", name, label[0] ? "{" : "", label,
+			label[0] ? "}" : "", sum);
+	fprintf(out, "%s_count%s%s%s %lu\n", name, label[0] ? "{" : "", label,
+			label[0] ? "}" : "", cum);
+}
+
+
+
+
+/*******************************************************************************
+ * sendAll
+ * sends all len bytes of buff, cutting the client off if it does not take
+ * them by the send deadline.
+ *
+ * ****************************************************************************/
+void sendAll(int connFD, char* buff, int len){
+	int totalSent = 0;
+	int charsWritten;
+
+	setSendDeadline(len);
+	while (totalSent < len){
+		charsWritten = send(connFD, buff + totalSent, len - totalSent,
+				MSG_DONTWAIT);
+		if (charsWritten < 0 && (errno == EAGAIN || errno == EINTR)){
+			if (waitWritable(connFD) < 0)
+				timedOut();
+			continue;
+		}
+		if (charsWritten < 0)
+			error("ERROR writing to socket");
+		sendProgress(charsWritten);
+		totalSent += charsWritten;
+	}
+	sendHandedOver(connFD);
+}
+
+
+
+
+/*******************************************************************************
+ * sendStats
+ * answers a stats request ("S" designator) by writing every counter and
+ * histogram to the client in Prometheus text exposition format, then
+ * returns so the caller can close the connection.
+ *
+ * ****************************************************************************/
+void sendStats(int connFD){
+	FILE* out;          // memory stream the report is built in
+	char* text = NULL;  // the finished report
+	size_t textLen = 0; // and its length
+	char label[32];     // phase="..." label
+	int i;
+
+	out = open_memstream(&text, &textLen);
+	if (out == NULL)
+		error("ERROR building stats");
+
+	fprintf(out, "# HELP otp_connections_accepted_total Connections accepted.\n"
+		"# TYPE otp_connections_accepted_total counter\n"
+		"otp_connections_accepted_total %lu\n",
+		__atomic_load_n(&stats->connAccepted, __ATOMIC_RELAXED));
+	fprintf(out, "# HELP otp_connections_rejected_total Connections refused "
+		"with an error status.\n"
+		"# TYPE otp_connections_rejected_total counter\n"
+		"otp_connections_rejected_total %lu\n",
+		__atomic_load_n(&stats->connRejected, __ATOMIC_RELAXED));
+	fprintf(out, "# HELP otp_connections_busy_total Connections turned away "
+		"with a retry status.\n"
+		"# TYPE otp_connections_busy_total counter\n"
+		"otp_connections_busy_total %lu\n",
+		__atomic_load_n(&stats->connBusy, __ATOMIC_RELAXED));
+	fprintf(out, "# HELP otp_handshake_failures_total Connections with a bad "
+		"or missing designator.\n"
+		"# TYPE otp_handshake_failures_total counter\n"
+		"otp_handshake_failures_total %lu\n",
+		__atomic_load_n(&stats->handshakeFails, __ATOMIC_RELAXED));
+	fprintf(out, "# HELP otp_active_workers Children currently serving a "
+		"connection.\n"
+		"# TYPE otp_active_workers gauge\n"
+		"otp_active_workers %ld\n",
+		__atomic_load_n(&stats->activeWorkers, __ATOMIC_RELAXED));
+	fprintf(out, "# HELP otp_requests_total Requests fully served.\n"
+		"# TYPE otp_requests_total counter\n"
+		"otp_requests_total %lu\n",
+		__atomic_load_n(&stats->requests, __ATOMIC_RELAXED));
+	fprintf(out, "# HELP otp_received_bytes_total Message and key bytes "
+		"received.\n"
+		"# TYPE otp_received_bytes_total counter\n"
+		"otp_received_bytes_total %lu\n",
+		__atomic_load_n(&stats->bytesIn, __ATOMIC_RELAXED));
+	fprintf(out, "# HELP otp_sent_bytes_total Result bytes sent.\n"
+		"# TYPE otp_sent_bytes_total counter\n"
+		"otp_sent_bytes_total %lu\n",
+		__atomic_load_n(&stats->bytesOut, __ATOMIC_RELAXED));
+
+	fprintf(out, "# HELP otp_traces_dropped_total Trace lines dropped because "
+		"the trace writer would have blocked.\n"
+		"# TYPE otp_traces_dropped_total counter\n"
+		"otp_traces_dropped_total %lu\n",
+		__atomic_load_n(&stats->tracesDropped, __ATOMIC_RELAXED));
+	fprintf(out, "# HELP otp_memory_reserved_bytes Request buffer memory "
+		"reserved against the budget.\n"
+		"# TYPE otp_memory_reserved_bytes gauge\n"
+		"otp_memory_reserved_bytes %lu\n",
+		__atomic_load_n(&stats->memReserved, __ATOMIC_RELAXED));
+	fprintf(out, "# HELP otp_memory_waits_total Requests that waited for "
+		"memory budget.\n"
+		"# TYPE otp_memory_waits_total counter\n"
+		"otp_memory_waits_total %lu\n",
+		__atomic_load_n(&stats->memWaits, __ATOMIC_RELAXED));
+	fprintf(out, "# HELP otp_timeouts_total Clients cut off for missing a "
+		"deadline.\n"
+		"# TYPE otp_timeouts_total counter\n"
+		"otp_timeouts_total %lu\n",
+		__atomic_load_n(&stats->timeouts, __ATOMIC_RELAXED));
+	fprintf(out, "# HELP otp_zerocopy_sends_total Results sent with "
+		"MSG_ZEROCOPY.\n"
+		"# TYPE otp_zerocopy_sends_total counter\n"
+		"otp_zerocopy_sends_total %lu\n"
+		"# HELP otp_zerocopy_copied_total Connections where the kernel "
+		"copied zero copy sends anyway.\n"
+		"# TYPE otp_zerocopy_copied_total counter\n"
+		"otp_zerocopy_copied_total %lu\n",
+		__atomic_load_n(&stats->zeroCopySends, __ATOMIC_RELAXED),
+		__atomic_load_n(&stats->zeroCopyCopied, __ATOMIC_RELAXED));
+	fprintf(out, "# HELP otp_checksum_errors_total Requests that failed "
+		"their CRC32C.\n"
+		"# TYPE otp_checksum_errors_total counter\n"
+		"otp_checksum_errors_total %lu\n",
+		__atomic_load_n(&stats->checksumErrors, __ATOMIC_RELAXED));
+	fprintf(out, "# HELP otp_symbol_errors_total Requests with characters "
+		"outside their alphabet.\n"
+		"# TYPE otp_symbol_errors_total counter\n"
+		"otp_symbol_errors_total %lu\n",
+		__atomic_load_n(&stats->symbolErrors, __ATOMIC_RELAXED));
+
+	fprintf(out, "# HELP otp_request_size_bytes Message length per request.\n"
+		"# TYPE otp_request_size_bytes histogram\n");
+	writeHist(out, "otp_request_size_bytes", "", stats->sizeHist,
+		(double)__atomic_load_n(&stats->sizeSum, __ATOMIC_RELAXED), 1.0);
+
+	fprintf(out, "# HELP otp_phase_duration_seconds Time spent in each "
+		"request phase.\n"
+		"# TYPE otp_phase_duration_seconds histogram\n");
+	for (i = 0; i < PH_COUNT; i++){
+		sprintf(label, "phase=\"%s\"", phaseNames[i]);
+		writeHist(out, "otp_phase_duration_seconds", label,
+			stats->phaseHist[i],
+			__atomic_load_n(&stats->phaseSum[i], __ATOMIC_RELAXED) / 1e9,
+			1e-6);
+	}
+	fclose(out);
+
+	// send the report under the send deadline, a scraper that stops
+	// reading is cut off like any other client
+	sendAll(connFD, text, textLen);
+	free(text);
+}
+
+
+
+
+/*******************************************************************************
+ * decryptMsg
+ * takes the message in the cipherBuff and the keyBuff and combines them to form
+ * a plain text which will be located in the cipherBuff location. Overwrites
+ * the old cipherBuff values. The key's value is subtracted from each
+ * symbol's, offset by the size so it never goes negative, and looked up in
+ * the alphabet's wrap table. Returns -1 if a byte of either was outside the
+ * alphabet, 0 otherwise; the mask keeps such a byte's lookup inside the
+ * table, and the result is thrown away.
+ *
+ * ****************************************************************************/
+int decryptMsg(char* cipherBuff, char* keyBuff, int size,
+		const struct alphabet* a){
+	unsigned char c, k;        // the symbols' values
+	unsigned char seen = 0;    // every value looked up, ORed together
+	int i;   // for looping
+
+	// decrypt each char one by one
+	for (i = 0; i < size; i++){
+		c = a->value[(unsigned char)cipherBuff[i]];
+		k = a->value[(unsigned char)keyBuff[i]];
+		seen |= c | k;
+		cipherBuff[i] = a->wrap[(c - k + a->size) & WRAP_MASK];
+	}
+	return((seen & ALPHA_BAD_BIT) ? -1 : 0);
+}
+
+
+
+
+/*******************************************************************************
+ * xorMsg
+ * the binary pad mode (V2_FLAG_BYTES): XORs each byte of the message in
+ * msgBuff with the key, in place. Any byte is allowed, and the same call
+ * both encrypts and decrypts. Works 32 bytes at a time, which the compiler
+ * turns into vector instructions, then finishes the tail byte by byte.
+ *
+ * ****************************************************************************/
+typedef uint64_t xorBlock __attribute__((vector_size(32), aligned(1),
+		may_alias));
+
+void xorMsg(char* msgBuff, char* keyBuff, int size){
+	int i = 0;   // for looping
+
+	for (; i + (int)sizeof(xorBlock) <= size; i += sizeof(xorBlock))
+		*(xorBlock*)(msgBuff + i) ^= *(xorBlock*)(keyBuff + i);
+	for (; i < size; i++)
+		msgBuff[i] ^= keyBuff[i];
+}
+
+
+
+
+/*******************************************************************************
+ * addPid
+ * As background processes are created they are added to the pidArray and the
+ * count is incremented.
+ *
+ * ****************************************************************************/
+void addPid(pid_t pid){
+	// grow the array when full, clients may hold many connections
+	if (pidCount == pidCap){
+		pidCap = pidCap ? pidCap * 2 : 16;
+		pidArray = realloc(pidArray, pidCap * sizeof(pid_t));
+		if (pidArray == NULL)
+			error("ERROR growing pid array");
+	}
+	pidArray[pidCount] = pid;
+	pidCount++;
+}
+
+
+
+
+/*******************************************************************************
+ * removePid
+ * searches for (and should find) PID of a recently finished background process.
+ * When found the pid is removed from the array, the array count is decremented,
+ * and the pid values after the found pid are shifted down to fill the gap.
+ *
+ * ****************************************************************************/
+int removePid(pid_t targetPid){
+	int i;
+	int index = -1;
+
+	// loop throught pidArray looking for index of out target pid
+	for (i = 0; i < pidCount; i++){
+		// if we find it record location and break loop
+		if (pidArray[i] == targetPid){
+			index = i;
+			break;
+		}
+	}
+	// if we found the index
+	if (index != -1){
+		// shift pids down overwriting pid we want to remove
+		for (index; index < (pidCount) - 1; index++){
+			pidArray[index] = pidArray[index + 1];
+		}
+		// decrement our count of pid's in the array
+		pidCount--;
+	}
+}
+
+
+
+
+/*******************************************************************************
+ * reapChildren
+ * loops through pidArray and checks if any of the processes within have 
+ * finished. If so the process completin information is printed and the pid
+ * is removed from the pidArray. 
+ *
+ * ****************************************************************************/
+ void reapChildren(){
+	//printf("in reapChildren\n");
+	int i;          // for looping
+	int ret;        // tracks if removePid succeedes or fails
+	int childExit;  // stores result of how child exited
+	pid_t pid;    // holds return from waitpid call
+	// check each of the unreaped processes
+	for (i = 0; i < pidCount; i++){
+		pid = waitpid(pidArray[i], &childExit, WNOHANG);
+		// if we reapd a process
+		if ((int)pid > 0){
+			// remove the reaped child from the pidArray
+			removePid(pid);
+			//printf("reaped child: %d\n", (int)pid);
+			i--;
+			if (i < 0)
+				return;
+		}
+	}
+ }
+
+
+
+
+/*******************************************************************************
+ * killBG
+ * on program exit, loops through the array of background processes and
+ * terminates them.
+ *
+ * ****************************************************************************/
+void killBG(){
+	int i;          // for looping
+	int childExit;  // stoes result of how child exited
+
+	// for each child processes
+	for (i = 0; i < pidCount; i++){
+		kill(pidArray[i], SIGTERM);
+	}
+}
+
+
+
+
+/*******************************************************************************
+ * reapBG
+ * should be used after killBG. Loops through array of background process ids
+ * and because they should all be killed, proceedes to reap them.
+ *
+ * ****************************************************************************/
+void reapBG(){
+	int i;         // for looping
+	int childExit;  // stores result of how child exited
+
+	// for each unreaped process
+	for (i = 0; i < pidCount; i++){
+		waitpid(pidArray[i], &childExit, 0);
+	}
+}
+
+
+
+
+/*******************************************************************************
+ * reapProc
+ * called on receipt of a SIGTERM signal, kills off remaining child processes
+ * and then reaaps them.
+ *
+ * ****************************************************************************/
+void reapProc(){
+	killBG();
+	reapBG();
+	exit(1);
+}
+
+
+
+
+/*******************************************************************************
+ * graceful stop and reload
+ * SIGTERM and SIGHUP only set a flag; the accept loop, which waits with
+ * those signals unblocked only inside pselect, then stops accepting. For a
+ * reload (SIGHUP) a new instance is first exec'd from the same binary and
+ * arguments with the listening socket left open and named by -f, so new
+ * connections queue on the socket and the new instance takes them at once.
+ * The old instance then asks each child to finish the request it has in
+ * hand (SIGUSR1), waits for them all and exits. A second SIGTERM while
+ * draining kills the children as SIGTERM always used to.
+ *
+ * ****************************************************************************/
+volatile sig_atomic_t stopRequested = 0;     // SIGTERM or SIGHUP seen
+volatile sig_atomic_t reloadRequested = 0;   // SIGHUP: start a successor
+sigset_t acceptMask;        // the signal mask to wait for connections with
+int savedArgc;              // our arguments, for the successor
+char** savedArgv;
+char startPath[8192];       // argv[0], made absolute if it had a directory
+cpu_set_t startCPUs;        // the CPUs we were started on, before any -a
+
+
+
+
+/*******************************************************************************
+ * requestStop
+ * SIGTERM and SIGHUP handler, leaves the work to the accept loop.
+ *
+ * ****************************************************************************/
+void requestStop(int sig){
+	if (sig == SIGTERM && stopRequested && !reloadRequested)
+		reapProc();
+	if (sig == SIGHUP && !stopRequested)
+		reloadRequested = 1;
+	stopRequested = 1;
+}
+
+
+
+
+/*******************************************************************************
+ * finishUp
+ * SIGUSR1 handler in the children: finish the current request, then close
+ * instead of waiting for another.
+ *
+ * ****************************************************************************/
+void finishUp(int sig){
+	draining = 1;
+}
+
+
+
+
+/*******************************************************************************
+ * saveStartPath
+ * remembers how we were started, so a reload runs whatever binary is at
+ * that path by then. A relative path is taken from the directory we were
+ * started in; a bare name is left for execvp to find on PATH.
+ *
+ * ****************************************************************************/
+void saveStartPath(const char* argv0){
+	char cwd[4096];
+
+	if (argv0[0] != '/' && strchr(argv0, '/') != NULL &&
+			getcwd(cwd, sizeof(cwd)) != NULL)
+		snprintf(startPath, sizeof(startPath), "%s/%s", cwd, argv0);
+	else
+		snprintf(startPath, sizeof(startPath), "%s", argv0);
+}
+
+
+
+
+/*******************************************************************************
+ * startSuccessor
+ * execs a new instance of this daemon that inherits listenFD. Returns 0 once
+ * the exec has succeeded (the close-on-exec status pipe reads empty), -1 if
+ * it could not be started.
+ *
+ * ****************************************************************************/
+int startSuccessor(int listenFD){
+	int status[2];      // close on exec, carries errno if exec fails
+	char fdArg[16];     // listenFD as -f's argument
+	char** args;        // the successor's argv
+	int i, n = 0;
+	int execErr = 0;
+	pid_t pid;
+
+	if (pipe(status) < 0)
+		return(-1);
+	fcntl(status[1], F_SETFD, FD_CLOEXEC);
+
+	// the same arguments less any earlier -f, plus -f for the socket
+	args = calloc(savedArgc + 3, sizeof(char*));
+	if (args == NULL)
+		error("ERROR allocating memory");
+	sprintf(fdArg, "%d", listenFD);
+	args[n++] = savedArgv[0];
+	args[n++] = "-f";
+	args[n++] = fdArg;
+	for (i = 1; i < savedArgc; i++){
+		if (strcmp(savedArgv[i], "-f") == 0 ||
+				strcmp(savedArgv[i], "--fd") == 0){
+			i++;
+			continue;
+		}
+		if (strncmp(savedArgv[i], "--fd=", 5) == 0)
+			continue;
+		args[n++] = savedArgv[i];
+	}
+
+	pid = fork();
+	if (pid == 0){
+		close(status[0]);
+		sigprocmask(SIG_SETMASK, &acceptMask, NULL);
+		sched_setaffinity(0, sizeof(startCPUs), &startCPUs);
+
+		// exec the path we were started by, not /proc/self/exe, so an
+		// upgraded binary is picked up; only if nothing is there now is
+		// the running binary started again
+		if (strchr(startPath, '/') != NULL)
+			execv(startPath, args);
+		else
+			execvp(startPath, args);
+		execErr = errno;
+		execv("/proc/self/exe", args);
+		write(status[1], &execErr, sizeof(execErr));
+		_exit(1);
+	}
+	close(status[1]);
+	if (pid > 0 && read(status[0], &execErr, sizeof(execErr)) > 0)
+		waitpid(pid, NULL, 0);
+	close(status[0]);
+	free(args);
+
+	if (pid < 0 || execErr != 0){
+		fprintf(stderr, "SERVER: could not start new instance: %s\n",
+				strerror(pid < 0 ? errno : execErr));
+		return(-1);
+	}
+	return(0);
+}
+
+
+
+
+/*******************************************************************************
+ * shutDown
+ * acts on a stop or reload request. If a reload cannot start the new
+ * instance we keep serving; otherwise stop accepting, drain the children
+ * and exit.
+ *
+ * ****************************************************************************/
+void shutDown(int listenFD){
+	int i;
+
+	if (reloadRequested && startSuccessor(listenFD) < 0){
+		reloadRequested = stopRequested = 0;
+		return;
+	}
+	close(listenFD);
+
+	// let a second SIGTERM through while we wait
+	reloadRequested = 0;
+	sigprocmask(SIG_SETMASK, &acceptMask, NULL);
+	for (i = 0; i < pidCount; i++)
+		kill(pidArray[i], SIGUSR1);
+	memWake();
+	reapBG();
+	exit(0);
+}
+
+
+/*******************************************************************************
+ * worker placement
+ * optional CPU and NUMA placement. -a pins the accepting parent to a CPU
+ * list. -A hands each new connection the next CPU of a list, -N the next
+ * NUMA node of a list (any of that node's CPUs), round robin. A placed
+ * worker process, and the threads of a multiplexed connection which
+ * inherit its mask, stay there and allocate locally: a CPU placed worker
+ * from whichever node it runs on, a node placed one from its node. The
+ * worker's arena buffer is first touched after placement, so it is on
+ * that node too and the cipher loop never reads across the interconnect.
+ * -a only takes effect once all options are read, and every placement is
+ * checked against the CPUs the daemon was started on; without -A or -N a
+ * worker goes back to those CPUs rather than keep the parent's pin.
+ *
+ * ****************************************************************************/
+#define MPOL_PREFERRED 1     // set_mempolicy modes, as in numaif.h
+#define MPOL_LOCAL 4
+
+cpu_set_t* placeSets = NULL;   // CPUs of each placement
+int* placeNodes = NULL;        // node of each placement, -1 for a CPU list
+int placeCount = 0;
+int placeNext = 0;             // placement the next connection gets
+
+
+
+
+/*******************************************************************************
+ * parseCPUs
+ * reads a CPU list such as "0-3,8,10-11" into set, as the kernel prints
+ * them. Returns the number of CPUs, exiting on a malformed list.
+ *
+ * ****************************************************************************/
+int parseCPUs(const char* list, cpu_set_t* set){
+	const char* p = list;
+	char* end;
+	long first, last, cpu;
+
+	CPU_ZERO(set);
+	while (*p != '\0' && *p != '\n'){
+		first = last = strtol(p, &end, 10);
+		if (end == p)
+			break;
+		if (*end == '-'){
+			p = end + 1;
+			last = strtol(p, &end, 10);
+			if (end == p)
+				break;
+		}
+		if (first < 0 || last < first || last >= CPU_SETSIZE)
+			break;
+		for (cpu = first; cpu <= last; cpu++)
+			CPU_SET(cpu, set);
+		p = end;
+		if (*p == ',')
+			p++;
+	}
+	if ((*p != '\0' && *p != '\n') || CPU_COUNT(set) == 0){
+		fprintf(stderr, "ERROR: bad CPU list \"%s\"\n", list);
+		exit(1);
+	}
+	return(CPU_COUNT(set));
+}
+
+
+
+
+/*******************************************************************************
+ * checkPlacement
+ * exits unless the daemon was started with at least one CPU of set.
+ *
+ * ****************************************************************************/
+void checkPlacement(cpu_set_t* set){
+	cpu_set_t allowed;   // CPUs of set this process may use
+
+	CPU_AND(&allowed, &startCPUs, set);
+	if (CPU_COUNT(&allowed) == 0){
+		fprintf(stderr, "ERROR: no usable CPU in a placement\n");
+		exit(1);
+	}
+}
+
+
+
+
+/*******************************************************************************
+ * addPlacement
+ * appends a placement after checking we may run on its CPUs.
+ *
+ * ****************************************************************************/
+void addPlacement(cpu_set_t* set, int node){
+	checkPlacement(set);
+
+	placeSets = realloc(placeSets, (placeCount + 1) * sizeof(cpu_set_t));
+	placeNodes = realloc(placeNodes, (placeCount + 1) * sizeof(int));
+	if (placeSets == NULL || placeNodes == NULL)
+		error("ERROR allocating memory");
+	placeSets[placeCount] = *set;
+	placeNodes[placeCount] = node;
+	placeCount++;
+}
+
+
+
+
+/*******************************************************************************
+ * placeOnCPUs
+ * -A: one placement per CPU of list.
+ *
+ * ****************************************************************************/
+void placeOnCPUs(const char* list){
+	cpu_set_t all, one;
+	int cpu;
+
+	parseCPUs(list, &all);
+	for (cpu = 0; cpu < CPU_SETSIZE; cpu++){
+		if (!CPU_ISSET(cpu, &all))
+			continue;
+		CPU_ZERO(&one);
+		CPU_SET(cpu, &one);
+		addPlacement(&one, -1);
+	}
+}
+
+
+
+
+/*******************************************************************************
+ * placeOnNodes
+ * -N: one placement per NUMA node of list, with the CPUs sysfs gives it.
+ *
+ * ****************************************************************************/
+void placeOnNodes(const char* list){
+	cpu_set_t nodes, cpus;
+	char path[64];
+	char cpuList[1024];
+	int node, fd, n;
+
+	parseCPUs(list, &nodes);
+	for (node = 0; node < CPU_SETSIZE; node++){
+		if (!CPU_ISSET(node, &nodes))
+			continue;
+		if (node >= 64){
+			fprintf(stderr, "ERROR: NUMA node %d out of range\n", node);
+			exit(1);
+		}
+		sprintf(path, "/sys/devices/system/node/node%d/cpulist", node);
+		fd = open(path, O_RDONLY);
+		if (fd < 0){
+			fprintf(stderr, "ERROR: no NUMA node %d\n", node);
+			exit(1);
+		}
+		n = read(fd, cpuList, sizeof(cpuList) - 1);
+		close(fd);
+		cpuList[n > 0 ? n : 0] = '\0';
+		parseCPUs(cpuList, &cpus);
+		addPlacement(&cpus, node);
+	}
+}
+
+
+
+
+/*******************************************************************************
+ * placeSelf
+ * moves this process onto set and makes its allocations come from node,
+ * or from whichever node it is running on when node is -1. Best effort: a
+ * kernel without NUMA support just keeps its default policy.
+ *
+ * ****************************************************************************/
+void placeSelf(cpu_set_t* set, int node){
+	unsigned long nodeMask;   // the node, for MPOL_PREFERRED
+
+	sched_setaffinity(0, sizeof(cpu_set_t), set);
+	if (node >= 0){
+		nodeMask = 1UL << node;
+		syscall(SYS_set_mempolicy, MPOL_PREFERRED, &nodeMask,
+				sizeof(nodeMask) * 8);
+	}
+	else
+		syscall(SYS_set_mempolicy, MPOL_LOCAL, NULL, 0);
+}
+
+
+
+
+/*******************************************************************************
+ * placeWorker
+ * in a newly forked worker: takes the placement that is next in turn, or
+ * with none given leaves the parent's -a pin for the CPUs we started on.
+ *
+ * ****************************************************************************/
+void placeWorker(){
+	if (placeCount == 0){
+		sched_setaffinity(0, sizeof(startCPUs), &startCPUs);
+		return;
+	}
+	placeSelf(&placeSets[placeNext % placeCount],
+			placeNodes[placeNext % placeCount]);
+}
+
+
+
+
+/*******************************************************************************
+ * zero copy sends
+ * results of zcThreshold bytes or more are sent with MSG_ZEROCOPY: the
+ * kernel transmits straight from the result buffer instead of copying it
+ * into socket buffers, and reports on the socket's error queue once it no
+ * longer needs each send's pages. Until then the buffer must not be
+ * written or freed, so each buffer remembers the number of zero copy sends
+ * that covers it (zcSeq) and zcWait is called before it is touched again.
+ * Where the kernel has to copy after all (loopback, or a device without
+ * scatter-gather) it says so, and the connection goes back to plain sends,
+ * which are cheaper when a copy is made anyway.
+ *
+ * ****************************************************************************/
+#ifndef SO_ZEROCOPY
+#define SO_ZEROCOPY 60
+#endif
+#ifndef MSG_ZEROCOPY
+#define MSG_ZEROCOPY 0x4000000
+#endif
+
+long zcThreshold = 65536;   // -Z: smallest result sent zero copy, 0 never
+int zcState = 0;            // 1 on, 0 not tried yet, -1 off
+int zcFD = -1;              // the connection the sends were on
+unsigned int zcSent = 0;    // zero copy sends issued
+unsigned int zcDone = 0;    // of those, how many the kernel has finished
+pthread_mutex_t zcLock = PTHREAD_MUTEX_INITIALIZER;   // one reader of the
+                                                      // error queue at once
+
+
+
+
+/*******************************************************************************
+ * zcReap
+ * reads zero copy completions off the error queue, waiting for at least one
+ * if block is set. Returns -1 when the connection has gone and no more will
+ * come.
+ *
+ * ****************************************************************************/
+int zcReap(int block){
+	char control[128];              // room for the completion messages
+	struct msghdr msg;
+	struct cmsghdr* cm;
+	struct sock_extended_err* ee;
+	struct pollfd pfd;
+	int gone = 0;
+
+	pthread_mutex_lock(&zcLock);
+	while (1){
+		memset(&msg, 0, sizeof(msg));
+		msg.msg_control = control;
+		msg.msg_controllen = sizeof(control);
+		if (recvmsg(zcFD, &msg, MSG_ERRQUEUE | MSG_DONTWAIT) >= 0){
+			for (cm = CMSG_FIRSTHDR(&msg); cm != NULL;
+					cm = CMSG_NXTHDR(&msg, cm)){
+				ee = (struct sock_extended_err*)CMSG_DATA(cm);
+				if (ee->ee_errno != 0 ||
+						ee->ee_origin != SO_EE_ORIGIN_ZEROCOPY)
+					continue;
+
+				// sends ee_info to ee_data are finished
+				if ((int)(ee->ee_data + 1 - zcDone) > 0)
+					zcDone = ee->ee_data + 1;
+				if (ee->ee_code & SO_EE_CODE_ZEROCOPY_COPIED){
+					if (zcState > 0)
+						STAT_ADD(zeroCopyCopied, 1);
+					zcState = -1;
+				}
+			}
+			block = 0;
+			continue;
+		}
+		if ((errno != EAGAIN && errno != EWOULDBLOCK) || gone){
+			gone = 1;
+			break;
+		}
+		if (!block)
+			break;
+
+		// nothing queued yet, an error queue entry shows as POLLERR;
+		// the kernel only finishes once the client takes the data
+		pfd.fd = zcFD;
+		pfd.events = 0;
+		if (sendTimeLeft() == 0){
+			pthread_mutex_unlock(&zcLock);
+			timedOut();
+		}
+		if (poll(&pfd, 1, sendTimeLeft()) < 0 && errno != EINTR)
+			error("ERROR polling socket");
+		if (pfd.revents & (POLLHUP | POLLNVAL))
+			gone = 1;
+	}
+	pthread_mutex_unlock(&zcLock);
+
+	return(gone ? -1 : 0);
+}
+
+
+
+
+/*******************************************************************************
+ * zcWait
+ * waits until the kernel is done with the first seq zero copy sends, so
+ * the buffer they came from can be used again.
+ *
+ * ****************************************************************************/
+void zcWait(unsigned int seq){
+	while ((int)(__atomic_load_n(&zcDone, __ATOMIC_ACQUIRE) - seq) < 0){
+		if (zcReap(1) < 0)
+			return;
+	}
+}
+
+
+
+
+/*******************************************************************************
+ * buffer arenas
+ * request buffers are kept and reused rather than allocated per request:
+ * each worker process has one arena buffer, and a multiplexed connection
+ * keeps its finished jobs, buffers included, on a free list. A buffer grows
+ * in powers of two up to arenaChunk bytes and is kept; a request larger
+ * than that gets a buffer of its own for just that request. Every request
+ * buffer, in every process, is first reserved against memBudget in the
+ * shared statistics block, so huge concurrent requests wait for memory
+ * instead of pushing the host into swap. Unless -M says otherwise the
+ * budget is half the host's memory.
+ *
+ * ****************************************************************************/
+#define HUGE_PAGE (2UL << 20)          // buffers this big use huge pages
+
+unsigned long arenaChunk = 1 << 20;   // largest buffer kept between requests
+unsigned long memBudget = 0;          // bytes all workers may reserve, 0 for
+                                      // no limit; see defaultBudget
+
+struct arena {
+	char* buff;             // the kept buffer
+	size_t cap;             // bytes in buff
+	char* big;              // buffer of the current oversized request
+	size_t bigCap;          // bytes in big
+	unsigned int zcSeq;     // zero copy sends to wait for before reuse
+};
+
+struct arena arena;         // this worker's arena
+unsigned long memHeld = 0;  // bytes this worker has reserved
+
+
+
+
+/*******************************************************************************
+ * reserveMem
+ * reserves bytes of the memory budget, waiting while the other workers hold
+ * too much of it, but no longer than the current deadline and not once the
+ * worker has been asked to finish up. The wait sleeps on the memReleases
+ * futex, so a worker wakes as soon as memory is returned (memWake) and
+ * costs nothing meanwhile. Returns -1, reserving nothing, with errno E2BIG
+ * if bytes is more than the whole budget or EAGAIN if the wait ran out.
+ *
+ * ****************************************************************************/
+int reserveMem(unsigned long bytes){
+	struct timespec wait;     // time left before the deadline
+	unsigned long held;       // bytes reserved by everyone
+	unsigned int seen;        // memReleases when held was read
+	long long left;
+	int waited = 0;
+
+	if (memBudget > 0 && bytes > memBudget){
+		errno = E2BIG;
+		return(-1);
+	}
+
+	while (1){
+		// a release after this read changes the word, and the sleep
+		// below then returns at once
+		seen = __atomic_load_n(&stats->memReleases, __ATOMIC_SEQ_CST);
+		held = __atomic_load_n(&stats->memReserved, __ATOMIC_SEQ_CST);
+		if (memBudget == 0 || held + bytes <= memBudget){
+			if (__atomic_compare_exchange_n(&stats->memReserved, &held,
+						held + bytes, 0, __ATOMIC_SEQ_CST,
+						__ATOMIC_SEQ_CST))
+				break;
+			continue;
+		}
+
+		if (!waited){
+			STAT_ADD(memWaits, 1);
+			waited = 1;
+		}
+		left = deadline - nowNs();
+		if (draining || (deadline != 0 && left <= 0)){
+			errno = EAGAIN;
+			return(-1);
+		}
+		wait.tv_sec = left / 1000000000LL;
+		wait.tv_nsec = left % 1000000000LL;
+		__atomic_add_fetch(&stats->memSleepers, 1, __ATOMIC_SEQ_CST);
+		syscall(SYS_futex, &stats->memReleases, FUTEX_WAIT, seen,
+				deadline != 0 ? &wait : NULL, NULL, 0);
+		__atomic_sub_fetch(&stats->memSleepers, 1, __ATOMIC_SEQ_CST);
+	}
+	__atomic_fetch_add(&memHeld, bytes, __ATOMIC_RELAXED);
+
+	return(0);
+}
+
+
+
+
+/*******************************************************************************
+ * defaultBudget
+ * the memory budget without -M: half of physical memory, so that claimed
+ * lengths alone can never reserve the whole host.
+ *
+ * ****************************************************************************/
+unsigned long defaultBudget(){
+	long pages = sysconf(_SC_PHYS_PAGES);
+	long pageSize = sysconf(_SC_PAGESIZE);
+
+	if (pages <= 0 || pageSize <= 0)
+		return(1UL << 30);
+	return((unsigned long)pages * pageSize / 2);
+}
+
+
+
+
+/*******************************************************************************
+ * releaseMem
+ * returns bytes to the memory budget.
+ *
+ * ****************************************************************************/
+void releaseMem(unsigned long bytes){
+	__atomic_fetch_sub(&stats->memReserved, bytes, __ATOMIC_SEQ_CST);
+	__atomic_fetch_sub(&memHeld, bytes, __ATOMIC_RELAXED);
+	memWake();
+}
+
+
+
+
+/*******************************************************************************
+ * bufAlloc
+ * allocates a request buffer of size bytes. A buffer of a huge page or more
+ * (growBuff rounds those to whole huge pages) is mapped from huge pages:
+ * the hugetlb pool if the host has pages reserved, transparent huge pages
+ * otherwise. It is not faulted in up front: the buffer is sized from the
+ * length a client claims before any of the payload has come, so its pages
+ * are only touched, a huge page per fault, as the payload is written into
+ * them, and a client that stalls holds no more memory than it has sent.
+ * Smaller buffers come from malloc; request buffers never need zeroing.
+ *
+ * ****************************************************************************/
+char* bufAlloc(size_t size){
+	char* buff;
+
+	if (size < HUGE_PAGE){
+		buff = malloc(size);
+		if (buff == NULL)
+			error("ERROR allocating request buffer");
+		return(buff);
+	}
+
+	buff = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_PRIVATE |
+			MAP_ANONYMOUS | MAP_HUGETLB, -1, 0);
+	if (buff != MAP_FAILED)
+		return(buff);
+
+	buff = mmap(NULL, size, PROT_READ | PROT_WRITE,
+			MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+	if (buff == MAP_FAILED)
+		error("ERROR allocating request buffer");
+	madvise(buff, size, MADV_HUGEPAGE);
+	return(buff);
+}
+
+
+
+
+/*******************************************************************************
+ * bufFree
+ * frees a buffer from bufAlloc of size bytes.
+ *
+ * ****************************************************************************/
+void bufFree(char* buff, size_t size){
+	if (buff == NULL)
+		return;
+	if (size < HUGE_PAGE)
+		free(buff);
+	else
+		munmap(buff, size);
+}
+
+
+
+
+/*******************************************************************************
+ * buffSize
+ * the size of buffer allocated for need bytes. Sizes up to arenaChunk are
+ * rounded up to a power of two (at least 4KB) so a reused buffer rarely
+ * grows twice, and from a huge page up to whole huge pages, as long as the
+ * rounding does not take it over the memory budget.
+ *
+ * ****************************************************************************/
+size_t buffSize(size_t need){
+	size_t size = 4096;
+
+	if (need > arenaChunk)
+		size = need;
+	while (size < need)
+		size <<= 1;
+	if (size >= HUGE_PAGE)
+		size = (size + HUGE_PAGE - 1) & ~(HUGE_PAGE - 1);
+	if (memBudget > 0 && size > memBudget && need <= memBudget)
+		size = need;
+	return(size);
+}
+
+
+
+
+/*******************************************************************************
+ * growBuff
+ * makes buff, which holds *cap bytes, hold at least need bytes (buffSize of
+ * them), reserving the extra memory first. The contents are not kept:
+ * buffers are only grown before a request is read into them. Returns the
+ * buffer, or NULL with errno set as reserveMem has it if the memory could
+ * not be had.
+ *
+ * ****************************************************************************/
+char* growBuff(char* buff, size_t* cap, size_t need){
+	size_t newCap;
+
+	if (need <= *cap)
+		return(buff);
+
+	newCap = buffSize(need);
+	if (reserveMem(newCap - *cap) < 0)
+		return(NULL);
+	bufFree(buff, *cap);
+	buff = bufAlloc(newCap);
+	*cap = newCap;
+
+	return(buff);
+}
+
+
+
+
+/*******************************************************************************
+ * arenaGet
+ * returns a buffer of at least need bytes from this worker's arena, valid
+ * until arenaPut, or NULL as growBuff has it. The kept buffer is given up
+ * first when keeping it would leave too little of the budget for an
+ * oversized request, since no other worker can release it.
+ *
+ * ****************************************************************************/
+char* arenaGet(size_t need){
+	zcWait(arena.zcSeq);
+	if (need > arenaChunk){
+		if (memBudget > 0 && arena.buff != NULL && buffSize(need) +
+				__atomic_load_n(&memHeld, __ATOMIC_RELAXED) >
+				memBudget){
+			bufFree(arena.buff, arena.cap);
+			releaseMem(arena.cap);
+			arena.buff = NULL;
+			arena.cap = 0;
+		}
+		arena.big = growBuff(arena.big, &arena.bigCap, need);
+		return(arena.big);
+	}
+
+	arena.buff = growBuff(arena.buff, &arena.cap, need);
+	return(arena.buff);
+}
+
+
+
+
+/*******************************************************************************
+ * arenaPut
+ * ends the current request's use of the arena: an oversized buffer is freed
+ * and its memory returned to the budget, the kept buffer stays.
+ *
+ * ****************************************************************************/
+void arenaPut(){
+	if (arena.big == NULL)
+		return;
+
+	zcWait(arena.zcSeq);
+	bufFree(arena.big, arena.bigCap);
+	releaseMem(arena.bigCap);
+	arena.big = NULL;
+	arena.bigCap = 0;
+}
+
+
+
+
+/*******************************************************************************
+ * memDone
+ * runs at exit in each worker: returns whatever it still holds to the
+ * budget, however it exits.
+ *
+ * ****************************************************************************/
+void memDone(){
+	releaseMem(__atomic_load_n(&memHeld, __ATOMIC_RELAXED));
+}
+
+
+
+
+/*******************************************************************************
+ * parseSize
+ * reads a byte count with an optional K, M or G suffix.
+ *
+ * ****************************************************************************/
+unsigned long parseSize(const char* text){
+	char* end;          // first character after the number
+	unsigned long n = strtoul(text, &end, 10);
+
+	switch (*end){
+		case 'k': case 'K':
+			n <<= 10;
+			break;
+		case 'm': case 'M':
+			n <<= 20;
+			break;
+		case 'g': case 'G':
+			n <<= 30;
+			break;
+	}
+	return(n);
+}
+
+
+
+
+/*******************************************************************************
+ * socket tuning
+ * -P sets TCP options from a profile and/or one by one, comma separated:
+ * "latency" (TCP_NODELAY, TCP_QUICKACK, deep backlog), "bulk" (4MB socket
+ * buffers, TCP_CORK around each reply, deferred accept, deep backlog), or
+ * name=value for nodelay, cork, quickack, sndbuf, rcvbuf, backlog and
+ * defer (seconds to hold a connection until it sends something). Later
+ * entries win, so "bulk,nodelay=1" works. Anything not set keeps the
+ * kernel default, and the backlog stays at 5.
+ *
+ * ****************************************************************************/
+struct tuning {
+	int nodelay;        // TCP_NODELAY, -1 to leave alone
+	int cork;           // TCP_CORK from "goods" until the result is out
+	int quickack;       // TCP_QUICKACK before reading each request
+	int sndbuf;         // SO_SNDBUF bytes, 0 for the kernel's
+	int rcvbuf;         // SO_RCVBUF bytes, 0 for the kernel's
+	int backlog;        // listen backlog
+	int defer;          // TCP_DEFER_ACCEPT seconds, 0 off
+};
+
+struct tuning tune = { -1, 0, 0, 0, 0, 5, 0 };
+
+
+
+
+/*******************************************************************************
+ * parseTuning
+ * applies a -P specification to tune, exiting on anything unknown.
+ *
+ * ****************************************************************************/
+void parseTuning(char* spec){
+	char* copy = strdup(spec);
+	char* item;
+	char* value;
+	char* save;
+	long n;
+
+	for (item = strtok_r(copy, ",", &save); item != NULL;
+			item = strtok_r(NULL, ",", &save)){
+		if (strcmp(item, "latency") == 0){
+			tune.nodelay = 1;
+			tune.quickack = 1;
+			tune.cork = 0;
+			tune.backlog = 1024;
+			continue;
+		}
+		if (strcmp(item, "bulk") == 0){
+			tune.nodelay = 0;
+			tune.cork = 1;
+			tune.sndbuf = tune.rcvbuf = 4 << 20;
+			tune.defer = 1;
+			tune.backlog = 1024;
+			continue;
+		}
+
+		value = strchr(item, '=');
+		if (value == NULL)
+			goto bad;
+		*value++ = '\0';
+		n = parseSize(value);
+		if (strcmp(item, "nodelay") == 0)
+			tune.nodelay = n != 0;
+		else if (strcmp(item, "cork") == 0)
+			tune.cork = n != 0;
+		else if (strcmp(item, "quickack") == 0)
+			tune.quickack = n != 0;
+		else if (strcmp(item, "sndbuf") == 0)
+			tune.sndbuf = n;
+		else if (strcmp(item, "rcvbuf") == 0)
+			tune.rcvbuf = n;
+		else if (strcmp(item, "backlog") == 0 && n > 0)
+			tune.backlog = n;
+		else if (strcmp(item, "defer") == 0)
+			tune.defer = n;
+		else
+			goto bad;
+	}
+	free(copy);
+	return;
+
+bad:
+	fprintf(stderr, "ERROR: bad socket tuning \"%s\"\n", spec);
+	exit(1);
+}
+
+
+
+
+/*******************************************************************************
+ * tuneListener
+ * options set on the listening socket: buffer sizes, which accepted
+ * sockets inherit and which must be set before the connection is made to
+ * size the TCP window, and deferred accept. Set on a socket we opened and
+ * on one handed over (-f, LISTEN_FDS) alike.
+ *
+ * ****************************************************************************/
+void tuneListener(int listenFD){
+	if (tune.sndbuf > 0)
+		setsockopt(listenFD, SOL_SOCKET, SO_SNDBUF, &tune.sndbuf,
+				sizeof(tune.sndbuf));
+	if (tune.rcvbuf > 0)
+		setsockopt(listenFD, SOL_SOCKET, SO_RCVBUF, &tune.rcvbuf,
+				sizeof(tune.rcvbuf));
+	if (tune.defer > 0)
+		setsockopt(listenFD, IPPROTO_TCP, TCP_DEFER_ACCEPT, &tune.defer,
+				sizeof(tune.defer));
+}
+
+
+
+
+/*******************************************************************************
+ * tuneConnection
+ * options set on each accepted connection.
+ *
+ * ****************************************************************************/
+void tuneConnection(int connFD){
+	if (tune.nodelay >= 0)
+		setsockopt(connFD, IPPROTO_TCP, TCP_NODELAY, &tune.nodelay,
+				sizeof(tune.nodelay));
+}
+
+
+
+
+/*******************************************************************************
+ * corkReply
+ * with cork set, holds partial frames back while on is set, so a reply's
+ * status or frame header leaves in the same packet as its result.
+ *
+ * ****************************************************************************/
+void corkReply(int connFD, int on){
+	if (tune.cork)
+		setsockopt(connFD, IPPROTO_TCP, TCP_CORK, &on, sizeof(on));
+}
+
+
+
+
+/*******************************************************************************
+ * quickAck
+ * with quickack set, acknowledges what arrives at once instead of after
+ * the delayed ACK timer. The kernel drops back to delayed ACKs by itself,
+ * so it is set again before each request is read.
+ *
+ * ****************************************************************************/
+void quickAck(int connFD){
+	int on = 1;
+
+	if (tune.quickack)
+		setsockopt(connFD, IPPROTO_TCP, TCP_QUICKACK, &on, sizeof(on));
+}
+
+
+
+
+/*******************************************************************************
+ * multiplexed connections
+ * a client that opens with "M" followed by the designator gets a
+ * multiplexed connection. After the "goods" reply it may send any number of
+ * frames without waiting: 10 byte request id, 10 byte length, message, '@'
+ * sentinel, key. The child reads frames and queues them for a pool of
+ * worker threads, which answer each as soon as it is done with 10 byte
+ * request id, 10 byte length, result. Replies can come back in any order;
+ * the client matches them by id.
+ *
+ * ****************************************************************************/
+struct muxJob {
+	int id;                 // client's request id
+	int size;               // message length
+	char* msg;              // message, decrypted in place, then the key
+	char* key;              // key bytes, within msg
+	size_t cap;             // bytes in msg
+	unsigned int zcSeq;     // zero copy sends to wait for before reuse
+	long long queuedNs;     // monotonic stamp when it was queued
+	struct reqTrace tr;     // this request's trace record
+	struct muxJob* next;    // next job in the queue
+};
+
+int muxThreads = 4;          // worker threads per multiplexed connection
+int muxMaxQueued = 64;       // frames read ahead before the reader waits
+
+struct muxJob* muxHead = NULL;    // queue of frames waiting for a worker
+struct muxJob* muxTail = NULL;
+struct muxJob* muxFree = NULL;    // finished jobs kept for reuse
+int muxQueued = 0;                // jobs in the queue
+int muxClosing = 0;               // set when the client has hung up
+pthread_mutex_t muxLock = PTHREAD_MUTEX_INITIALIZER;
+pthread_cond_t muxNotEmpty = PTHREAD_COND_INITIALIZER;
+pthread_cond_t muxNotFull = PTHREAD_COND_INITIALIZER;
+pthread_mutex_t muxSendLock = PTHREAD_MUTEX_INITIALIZER;  // one reply at a time
+
+// largest chunk a streamed request may send
+#define STREAM_MAX_CHUNK (1 << 20)
+
+
+
+
+/*******************************************************************************
+ * recvAll
+ * reads exactly len bytes unless the peer hangs up first. Returns how many
+ * bytes were read, so 0 means the peer closed before sending anything. An
+ * idle client that runs out of time before sending anything counts as
+ * having hung up; any other missed deadline cuts the client off.
+ *
+ * ****************************************************************************/
+int recvAll(int connFD, char* buff, int len){
+	int readTotal = 0;
+	int charsRead;
+
+	while (readTotal < len){
+		if (waitReadable(connFD) < 0){
+			if (idleWait && readTotal == 0)
+				break;
+			timedOut();
+		}
+		charsRead = recv(connFD, buff + readTotal, len - readTotal, 0);
+		if (charsRead < 0)
+			error("ERROR reading from socket");
+		if (charsRead == 0)
+			break;
+		recvProgress(charsRead);
+		readTotal += charsRead;
+	}
+	return(readTotal);
+}
+
+
+
+
+/*******************************************************************************
+ * sendResult
+ * sends a result of len bytes from buff, zero copy if it is large enough
+ * and the connection allows it, under the same send deadline as sendAll.
+ * Returns the zcSeq buff must be waited on with zcWait before it is written
+ * again.
+ *
+ * ****************************************************************************/
+unsigned int sendResult(int connFD, char* buff, int len){
+	int on = 1;
+	int totalSent = 0;
+	int charsWritten;
+
+	if (zcThreshold <= 0 || len < zcThreshold || zcState < 0){
+		sendAll(connFD, buff, len);
+		return(0);
+	}
+	if (zcState == 0){
+		zcState = setsockopt(connFD, SOL_SOCKET, SO_ZEROCOPY, &on,
+				sizeof(on)) == 0 ? 1 : -1;
+		zcFD = connFD;
+		if (zcState < 0){
+			sendAll(connFD, buff, len);
+			return(0);
+		}
+	}
+
+	setSendDeadline(len);
+	while (totalSent < len){
+		charsWritten = send(connFD, buff + totalSent, len - totalSent,
+				MSG_ZEROCOPY | MSG_DONTWAIT);
+		if (charsWritten < 0 && (errno == EAGAIN || errno == EINTR)){
+			if (waitWritable(connFD) < 0)
+				timedOut();
+			continue;
+		}
+		if (charsWritten < 0){
+			if (errno != ENOBUFS)
+				error("ERROR writing to socket");
+
+			// out of room to track completions: collect some, or copy
+			// the rest when none are outstanding
+			if (__atomic_load_n(&zcDone, __ATOMIC_ACQUIRE) ==
+					__atomic_load_n(&zcSent, __ATOMIC_ACQUIRE)){
+				sendAll(connFD, buff + totalSent, len - totalSent);
+				break;
+			}
+			zcReap(1);
+			continue;
+		}
+		__atomic_add_fetch(&zcSent, 1, __ATOMIC_RELEASE);
+		sendProgress(charsWritten);
+		totalSent += charsWritten;
+	}
+	sendHandedOver(connFD);
+	STAT_ADD(zeroCopySends, 1);
+
+	return(__atomic_load_n(&zcSent, __ATOMIC_ACQUIRE));
+}
+
+
+
+
+/*******************************************************************************
+ * protocol v2
+ * the request being served, v1 or v2 (see protocol.h), and the flags of a
+ * v2 one. A request that does not match its CRC32C is answered
+ * V2_BAD_CHECKSUM, and one with bytes outside its alphabet V2_BAD_SYMBOL.
+ *
+ * ****************************************************************************/
+int replyVersion = 1;        // protocol of the request being served
+int replyFlags = 0;          // its v2 flags, echoed in the reply
+
+
+
+
+/*******************************************************************************
+ * sendReply
+ * sends a request's status in its own protocol: a v2 header, or for v1
+ * "goods", "retry" and the wait, or "error" for any failure. length is the
+ * result's length, or the wait for V2_RETRY. A failed request is closed
+ * straight after, so its reply is sent without checking; the header of a
+ * result is held back to go out with it.
+ *
+ * ****************************************************************************/
+void sendReply(int connFD, int status, unsigned long length){
+	struct v2Header hdr;
+	char reply[16];     // "retry" and the wait in milliseconds
+	int sent;
+
+	if (replyVersion == 1){
+		if (status == V2_OK){
+			sendAll(connFD, "goods", 5);
+		}
+		else if (status == V2_RETRY){
+			sprintf(reply, "retry%010lu", length);
+			send(connFD, reply, 15, MSG_DONTWAIT);
+		}
+		else {
+			send(connFD, "error", 5, MSG_DONTWAIT);
+		}
+		return;
+	}
 
+	memset(&hdr, 0, sizeof(hdr));
+	hdr.magic = htons(V2_MAGIC);
+	hdr.version = V2_VERSION;
+	hdr.op = 'D';
+	hdr.flags = htons(replyFlags);
+	hdr.status = htons(status);
+	hdr.length = htobe64(length);
+	if (status != V2_OK){
+		send(connFD, (char*)&hdr, sizeof(hdr), MSG_DONTWAIT);
+		return;
+	}
 
+	// the result follows straight away, let them share a packet
+	sent = send(connFD, (char*)&hdr, sizeof(hdr), MSG_MORE | MSG_DONTWAIT);
+	if (sent < 0 && errno != EAGAIN)
+		error("ERROR writing to socket");
+	if (sent < 0)
+		sent = 0;
+	sendAll(connFD, (char*)&hdr + sent, sizeof(hdr) - sent);
+}
 
-// Error function used for reporting issues
-void error(const char *msg) { 
-	perror(msg); 
-	exit(1); 
+
+
+
+/*******************************************************************************
+ * recvHeader
+ * reads the rest of a v2 header whose first byte, first, has been read, and
+ * checks it. Returns V2_OK with the message length in size and its flags
+ * in replyFlags, or the status to refuse the request with.
+ *
+ * ****************************************************************************/
+int recvHeader(int connFD, char first, int* size){
+	struct v2Header hdr;
+	uint64_t length;
+
+	memcpy(&hdr, &first, 1);
+	if (recvAll(connFD, (char*)&hdr + 1, sizeof(hdr) - 1) <
+			(int)sizeof(hdr) - 1)
+		return(V2_REJECTED);
+
+	if (ntohs(hdr.magic) != V2_MAGIC)
+		return(V2_REJECTED);
+	if (hdr.version != V2_VERSION)
+		return(V2_BAD_VERSION);
+	if (hdr.op != 'D' || (ntohs(hdr.flags) &
+			~(V2_FLAG_CRC | V2_FLAG_BYTES | V2_FLAG_ALPHABET)) != 0)
+		return(V2_REJECTED);
+	replyFlags = ntohs(hdr.flags);
+
+	// an alphabet we do not have, or one given to a binary pad
+	if (V2_ALPHABET(replyFlags) >= NUM_ALPHABETS ||
+			((replyFlags & V2_FLAG_BYTES) &&
+			V2_ALPHABET(replyFlags) != ALPHA_TEXT))
+		return(V2_REJECTED);
+
+	// message and key must both fit one request buffer
+	length = be64toh(hdr.length);
+	if (length > INT_MAX / 2 - 1)
+		return(V2_TOO_LARGE);
+	*size = length;
+	return(V2_OK);
 }
 
 
 
 
 /*******************************************************************************
- * decryptMsg
- * takes the message in the cipherBuff and the keyBuff and combines them to form
- * a plain text which will be located in the cipherBuff location. Overwrites
- * the old cipherBuff values.
+ * admission control
+ * a new connection is turned away while the daemon is saturated: more than
+ * maxWorkers connections being served, or the whole memory budget reserved.
+ * Instead of "goods" its first request gets the status "retry" followed by
+ * the 10 byte number of milliseconds the client should wait before trying
+ * again, and the worker exits straight away.
  *
- * Note: 'A' = 65, 'Z' = 90
+ * ****************************************************************************/
+long maxWorkers = 0;        // connections served at once, 0 for no limit
+int retryMs = 100;          // wait suggested to clients turned away
+int admitted = 0;           // set once this connection has been let in
+
+
+
+
+/*******************************************************************************
+ * overloaded
+ * returns 1 if the daemon is over its limits, counting this worker.
  *
  * ****************************************************************************/
-void decryptMsg(char* cipherBuff, char* keyBuff, int size){
-	int i,   // for looping
-	    x,   // holds cipherbuff "chars"
-	    y,   // holds keyBuff "chars"
-	    z;   // holds the difference of cipher and key Buff "chars
+int overloaded(){
+	if (maxWorkers > 0 &&
+			__atomic_load_n(&stats->activeWorkers, __ATOMIC_RELAXED) >
+			maxWorkers)
+		return(1);
+	if (memBudget > 0 &&
+			__atomic_load_n(&stats->memReserved, __ATOMIC_RELAXED) >=
+			memBudget)
+		return(1);
+	return(0);
+}
 
-	// decrypt each char one by one
-	for (i = 0; i < size; i++){
-		// convert chars to ints
-		// for the cipherBuff
-		// if A - Z
-		if (cipherBuff[i] != ' '){
-			// subtract 65 to get us to values in range 0 - 25
-			x = (int)cipherBuff[i] - 65;
-		}
-		// else if ' ' 
-		else
-			x = 26;
-		// for the keyBuff
-		// if A - Z
-		if (keyBuff[i] != ' '){
-			// subtract 65 to get us to values in range 0 - 25
-			y = (int)keyBuff[i] - 65;
-		}
-		// else if ' '
-		else
-			y = 26;
 
-		// subtract the key
-		z = (x - y);
-		// if negative add 27 for wraparound
-		if (z < 0){
-			z += 27;
-		}
 
-		// convert the int value back to a capitol letter
-		z += 65;
 
-		// add it back to cipherBuff
-		if (z == 91)
-			cipherBuff[i] = ' ';
-		else
-			cipherBuff[i] = z;
+/*******************************************************************************
+ * sendGoods
+ * sends the "goods" status that lets a request go ahead, once the first
+ * request of the connection has passed admission control. A v2 request
+ * has no "goods", its status goes out with the result.
+ *
+ * ****************************************************************************/
+void sendGoods(int connFD){
+	if (!admitted && overloaded()){
+		sendReply(connFD, V2_RETRY, retryMs);
+		STAT_ADD(connBusy, 1);
+		trace.status = "busy";
+		emitTrace(&trace);
+		exit(0);
 	}
+	admitted = 1;
+
+	if (replyVersion == 1)
+		sendReply(connFD, V2_OK, 0);
+	setDeadline(headerMs, 0);
 }
 
 
 
 
 /*******************************************************************************
- * addPid
- * As background processes are created they are added to the pidArray and the
- * count is incremented.
+ * overBudget
+ * ends a worker whose request of size bytes could not get its buffer: too
+ * large for the memory budget, or no memory freed up before the deadline.
+ * reply says a v2 status can still go to the client, V2_TOO_LARGE or
+ * V2_RETRY; otherwise the connection is just closed.
  *
  * ****************************************************************************/
-void addPid(pid_t pid){
-	pidArray[pidCount] = pid;
-	pidCount++;
+void overBudget(int connFD, int size, int reply){
+	if (errno == EAGAIN){
+		fprintf(stderr, "SERVER: no memory for a request of %d bytes "
+				"in time\n", size);
+		if (reply)
+			sendReply(connFD, V2_RETRY, retryMs);
+		STAT_ADD(connBusy, 1);
+		trace.status = "busy";
+		emitTrace(&trace);
+		exit(1);
+	}
+
+	fprintf(stderr, "SERVER: request of %d bytes is over the memory "
+			"budget\n", size);
+	if (reply)
+		sendReply(connFD, V2_TOO_LARGE, 0);
+	exit(1);
 }
 
 
 
 
 /*******************************************************************************
- * removePid
- * searches for (and should find) PID of a recently finished background process.
- * When found the pid is removed from the array, the array count is decremented,
- * and the pid values after the found pid are shifted down to fill the gap.
+ * parseLength
+ * the fixed width decimal number in the len (at most 10) characters at
+ * text, as lengths and ids come on the wire, or -1 if they are not all
+ * digits or it is over max.
  *
  * ****************************************************************************/
-int removePid(pid_t targetPid){
-	int i;
-	int index = -1;
+long parseLength(const char* text, int len, long max){
+	char digits[11];   // text, terminated
+	char* end;
+	long n;
+
+	memcpy(digits, text, len);
+	digits[len] = '\0';
+	if (digits[0] < '0' || digits[0] > '9')
+		return(-1);
+	n = strtol(digits, &end, 10);
+	if (*end != '\0' || n > max)
+		return(-1);
+	return(n);
+}
 
-	// loop throught pidArray looking for index of out target pid
-	for (i = 0; i < pidCount; i++){
-		// if we find it record location and break loop
-		if (pidArray[i] == targetPid){
-			index = i;
+
+
+
+/*******************************************************************************
+ * refuseRequest
+ * ends a worker whose request is malformed or cannot be served: status
+ * goes back to the client (a v1 client gets "error") and the connection
+ * is closed.
+ *
+ * ****************************************************************************/
+void refuseRequest(int connFD, int status){
+	STAT_ADD(handshakeFails, 1);
+	STAT_ADD(connRejected, 1);
+	sendReply(connFD, status, 0);
+	trace.status = "error";
+	emitTrace(&trace);
+	exit(1);
+}
+
+
+
+
+/*******************************************************************************
+ * badSymbols
+ * ends a worker whose request of size bytes had message or key bytes
+ * outside its alphabet, which the clients check for before sending. reply
+ * says the v2 status V2_BAD_SYMBOL can still go to the client; otherwise
+ * the connection is just closed.
+ *
+ * ****************************************************************************/
+void badSymbols(int connFD, int size, int reply){
+	fprintf(stderr, "SERVER: request of %d bytes has characters outside "
+			"its alphabet\n", size);
+	STAT_ADD(symbolErrors, 1);
+	if (reply)
+		sendReply(connFD, V2_BAD_SYMBOL, 0);
+	trace.size = size;
+	trace.status = "symbols";
+	emitTrace(&trace);
+	exit(1);
+}
+
+
+
+
+/*******************************************************************************
+ * muxWorker
+ * worker thread body: takes queued frames, decrypts them and sends each reply
+ * as soon as it is ready. Returns once the client has hung up and the queue
+ * is empty.
+ *
+ * ****************************************************************************/
+void* muxWorker(void* arg){
+	int connFD = (int)(long)arg;
+	struct muxJob* job;
+	char header[21];        // reply id and length
+	long long start, now;   // monotonic stamps around each phase
+
+	while (1){
+		// wait for a frame, or for the end of the connection
+		pthread_mutex_lock(&muxLock);
+		while (muxHead == NULL && !muxClosing)
+			pthread_cond_wait(&muxNotEmpty, &muxLock);
+		if (muxHead == NULL){
+			pthread_mutex_unlock(&muxLock);
 			break;
 		}
+		job = muxHead;
+		muxHead = job->next;
+		if (muxHead == NULL)
+			muxTail = NULL;
+		muxQueued--;
+		pthread_cond_signal(&muxNotFull);
+		pthread_mutex_unlock(&muxLock);
+
+		// time spent waiting for a worker
+		start = nowNs();
+		recordPhase(PH_QUEUE, start - job->queuedNs);
+		job->tr.phaseNs[PH_QUEUE] = start - job->queuedNs;
+
+		// decrypt the message
+		if (decryptMsg(job->msg, job->key, job->size,
+				&alphabets[ALPHA_TEXT]) < 0)
+			badSymbols(connFD, job->size, 0);
+		now = nowNs();
+		recordPhase(PH_CIPHER, now - start);
+		job->tr.phaseNs[PH_CIPHER] = now - start;
+		start = now;
+
+		// send the reply in one piece
+		sprintf(header, "%010d%010d", job->id, job->size);
+		pthread_mutex_lock(&muxSendLock);
+		corkReply(connFD, 1);
+		sendAll(connFD, header, 20);
+		job->zcSeq = sendResult(connFD, job->msg, job->size);
+		corkReply(connFD, 0);
+		pthread_mutex_unlock(&muxSendLock);
+		now = nowNs();
+		recordPhase(PH_SEND, now - start);
+		job->tr.phaseNs[PH_SEND] = now - start;
+
+		// one request done, publish its totals
+		STAT_ADD(requests, 1);
+		STAT_ADD(bytesIn, 2 * job->size);
+		STAT_ADD(bytesOut, job->size + 20);
+		STAT_ADD(sizeHist[histBucket(job->size)], 1);
+		STAT_ADD(sizeSum, job->size);
+		job->tr.size = job->size;
+		job->tr.status = "goods";
+		emitTrace(&job->tr);
+
+		// keep the job for reuse, unless its buffer is oversized
+		if (job->cap > arenaChunk){
+			zcWait(job->zcSeq);
+			bufFree(job->msg, job->cap);
+			releaseMem(job->cap);
+			job->msg = NULL;
+			job->cap = 0;
+		}
+		pthread_mutex_lock(&muxLock);
+		job->next = muxFree;
+		muxFree = job;
+		pthread_mutex_unlock(&muxLock);
 	}
-	// if we found the index
-	if (index != -1){
-		// shift pids down overwriting pid we want to remove
-		for (index; index < (pidCount) - 1; index++){
-			pidArray[index] = pidArray[index + 1];
+
+	return(NULL);
+}
+
+
+
+
+/*******************************************************************************
+ * serveMux
+ * runs a multiplexed connection: starts the worker threads, then reads
+ * frames and queues them until the client hangs up. Waits for the workers
+ * to answer everything that was queued before returning.
+ *
+ * ****************************************************************************/
+void serveMux(int connFD){
+	pthread_t* workers;     // the worker threads
+	struct muxJob* job;
+	char header[21];        // frame id and length
+	char sentinel;          // the '@' between message and key
+	long long start, now;   // monotonic stamps around each phase
+	sigset_t usr1;          // just SIGUSR1
+	int i, charsRead;
+
+	// acknowledge the multiplexed connection
+	sendGoods(connFD);
+	markPhase(PH_HANDSHAKE);
+
+	// the threads inherit SIGUSR1 blocked, so finishUp always wakes this
+	// reader out of its wait for the next frame
+	sigemptyset(&usr1);
+	sigaddset(&usr1, SIGUSR1);
+	pthread_sigmask(SIG_BLOCK, &usr1, NULL);
+	workers = calloc(muxThreads, sizeof(pthread_t));
+	for (i = 0; i < muxThreads; i++){
+		if (pthread_create(&workers[i], NULL, muxWorker,
+					(void*)(long)connFD) != 0)
+			error("ERROR starting worker thread");
+	}
+	pthread_sigmask(SIG_UNBLOCK, &usr1, NULL);
+
+	while (1){
+		// a hang up (or going idle) between frames ends the connection
+		memset(header, '\0', sizeof(header));
+		setDeadline(handshakeMs, 1);
+		charsRead = recvAll(connFD, header, 20);
+		if (charsRead == 0)
+			break;
+		if (charsRead < 20)
+			error("ERROR reading frame header");
+		start = nowNs();
+
+		// reuse a finished job, and its buffer, when there is one
+		pthread_mutex_lock(&muxLock);
+		job = muxFree;
+		if (job)
+			muxFree = job->next;
+		pthread_mutex_unlock(&muxLock);
+		if (job == NULL)
+			job = calloc(1, sizeof(struct muxJob));
+		job->next = NULL;
+		zcWait(job->zcSeq);
+		resetTrace(&job->tr);
+		job->tr.startNs = trace.startNs;
+		// message and key must both fit one request buffer, as
+		// recvHeader holds v2 lengths to
+		job->size = parseLength(header + 10, 10, INT_MAX / 2 - 1);
+		job->id = parseLength(header, 10, INT_MAX);
+		if (job->size < 0 || job->id < 0){
+			fprintf(stderr, "SERVER: bad frame header\n");
+			refuseRequest(connFD, V2_TOO_LARGE);
 		}
-		// decrement our count of pid's in the array
-		pidCount--;
+		setPayloadDeadline(2 * (unsigned long)job->size + 1);
+
+		// message and key share one buffer
+		job->msg = growBuff(job->msg, &job->cap,
+				2 * ((size_t)job->size + 1));
+		if (job->msg == NULL)
+			overBudget(connFD, job->size, 0);
+		job->key = job->msg + job->size + 1;
+
+		// message, sentinel, key
+		if (recvAll(connFD, job->msg, job->size) < job->size ||
+				recvAll(connFD, &sentinel, 1) < 1)
+			error("ERROR reading msg from socket");
+		now = nowNs();
+		recordPhase(PH_PAYLOAD, now - start);
+		job->tr.phaseNs[PH_PAYLOAD] = now - start;
+		start = now;
+		if (recvAll(connFD, job->key, job->size) < job->size)
+			error("ERROR reading key from socket");
+		now = nowNs();
+		recordPhase(PH_KEY, now - start);
+		job->tr.phaseNs[PH_KEY] = now - start;
+		job->queuedNs = now;
+
+		// queue it, waiting if the workers are too far behind
+		pthread_mutex_lock(&muxLock);
+		while (muxQueued >= muxMaxQueued)
+			pthread_cond_wait(&muxNotFull, &muxLock);
+		if (muxTail)
+			muxTail->next = job;
+		else
+			muxHead = job;
+		muxTail = job;
+		muxQueued++;
+		pthread_cond_signal(&muxNotEmpty);
+		pthread_mutex_unlock(&muxLock);
+	}
+
+	// let the workers finish what is queued, then stop them
+	pthread_mutex_lock(&muxLock);
+	muxClosing = 1;
+	pthread_cond_broadcast(&muxNotEmpty);
+	pthread_mutex_unlock(&muxLock);
+	for (i = 0; i < muxThreads; i++)
+		pthread_join(workers[i], NULL);
+	free(workers);
+
+	// and release the kept jobs
+	zcWait(zcSent);
+	while (muxFree != NULL){
+		job = muxFree;
+		muxFree = job->next;
+		bufFree(job->msg, job->cap);
+		releaseMem(job->cap);
+		free(job);
 	}
 }
 
@@ -147,87 +2696,396 @@ int removePid(pid_t targetPid){
 
 
 /*******************************************************************************
- * reapChildren
- * loops through pidArray and checks if any of the processes within have 
- * finished. If so the process completin information is printed and the pid
- * is removed from the pidArray. 
+ * serveStream
+ * handles a streamed request, for input whose length the client does not
+ * know up front. Reads chunks of 10 byte length, message, '@' sentinel, key
+ * and answers each with its result as soon as it is in. A zero length chunk
+ * ends the stream. The whole stream counts as one request.
  *
  * ****************************************************************************/
- void reapChildren(){
-	//printf("in reapChildren\n");
-	int i;          // for looping
-	int ret;        // tracks if removePid succeedes or fails
-	int childExit;  // stores result of how child exited
-	pid_t pid;    // holds return from waitpid call
-	// check each of the unreaped processes
-	for (i = 0; i < pidCount; i++){
-		pid = waitpid(pidArray[i], childExit, WNOHANG);
-		// if we reapd a process
-		if ((int)pid > 0){
-			// remove the reaped child from the pidArray
-			removePid(pid);
-			//printf("reaped child: %d\n", (int)pid);
-			i--;
-			if (i < 0)
-				return;
+void serveStream(int connFD){
+	char header[11];    // length of the chunk
+	char sentinel;      // the '@' between message and key
+	char* cipherBuff;    // message of the current chunk
+	char* keyBuff;      // key of the current chunk
+	int size;           // bytes in the current chunk
+	long total = 0;     // message bytes in the whole stream
+
+	// acknowledge the streamed request
+	sendGoods(connFD);
+	markPhase(PH_HANDSHAKE);
+
+	while (1){
+		// chunk length, the next chunk has to come within handshakeMs
+		memset(header, '\0', sizeof(header));
+		if (total > 0)
+			setDeadline(handshakeMs, 0);
+		if (recvAll(connFD, header, 10) < 10)
+			error("ERROR reading chunk size");
+		size = parseLength(header, 10, STREAM_MAX_CHUNK);
+		if (size < 0){
+			fprintf(stderr, "SERVER: bad chunk size %s\n", header);
+			exit(1);
 		}
+		accumulatePhase(PH_HEADER);
+		setPayloadDeadline(2 * (unsigned long)size + 1);
+
+		// message and key share a buffer from the arena
+		cipherBuff = arenaGet(2 * ((size_t)size + 1));
+		if (cipherBuff == NULL)
+			overBudget(connFD, size, 0);
+		keyBuff = cipherBuff + size + 1;
+
+		// message, sentinel, key
+		if (recvAll(connFD, cipherBuff, size) < size ||
+				recvAll(connFD, &sentinel, 1) < 1)
+			error("ERROR reading msg from socket");
+		accumulatePhase(PH_PAYLOAD);
+		if (recvAll(connFD, keyBuff, size) < size)
+			error("ERROR reading key from socket");
+		accumulatePhase(PH_KEY);
+
+		// the empty chunk closes the stream
+		if (size == 0)
+			break;
+
+		if (decryptMsg(cipherBuff, keyBuff, size,
+				&alphabets[ALPHA_TEXT]) < 0)
+			badSymbols(connFD, size, 0);
+		accumulatePhase(PH_CIPHER);
+		arena.zcSeq = sendResult(connFD, cipherBuff, size);
+		accumulatePhase(PH_SEND);
+
+		STAT_ADD(bytesIn, 2 * size);
+		STAT_ADD(bytesOut, size);
+		total += size;
 	}
- }
+
+	// the stream is done, publish its totals
+	STAT_ADD(requests, 1);
+	STAT_ADD(sizeHist[histBucket(total)], 1);
+	STAT_ADD(sizeSum, total);
+	trace.size = total;
+	trace.status = "goods";
+
+	arenaPut();
+}
 
 
 
 
 /*******************************************************************************
- * killBG
- * on program exit, loops through the array of background processes and
- * terminates them.
+ * serveRequest
+ * handles one request once its designator has been read: acknowledges it,
+ * reads the 10 byte length, the cipher text, the '@' sentinel and the key,
+ * decrypts the message and sends the result back. A v2 request, whose
+ * header gave its length as size (-1 for v1), has no "goods" or sentinel;
+ * its reply header goes out with the result.
  *
  * ****************************************************************************/
-void killBG(){
-	int i;          // for looping
-	int childExit;  // stoes result of how child exited
+void serveRequest(int connFD, int size){
+	char buffer[11];    // to determine the length of cipher and key msgs
+	char* cipherBuff;   // will hold cipher text msg from client
+	char* keyBuff;      // will hold key text msg form client
+	int charsRead;
+	unsigned long bytesIn;   // payload + key bytes this request
+	uint32_t crc;            // CRC32C of the request, then of the result
+
+	// Send a Success message back to the client, held back with the
+	// result when corking
+	corkReply(connFD, 1);
+	sendGoods(connFD);
+	//printf("SERVER: connection good\n");
+	markPhase(PH_HANDSHAKE);
+
+	// get the size of the messages
+	if (replyVersion == 1){
+		memset(buffer, '\0', sizeof(buffer));
+		if (recvAll(connFD, buffer, 10) < 10) {
+			error("ERROR reading msg size");
+		}
+		//printf("SERVER: msg size is %s\n", buffer);
+
+		// change string val to int, held to what one request buffer
+		// takes, as a v2 length is
+		size = parseLength(buffer, 10, INT_MAX / 2 - 1);
+		if (size < 0){
+			fprintf(stderr, "SERVER: bad msg size\n");
+			refuseRequest(connFD, V2_TOO_LARGE);
+		}
+	}
+	markPhase(PH_HEADER);
+	setPayloadDeadline(2 * (unsigned long)size + (replyVersion == 1));
+
+	// cipher and key text share a buffer from the arena, with room for a
+	// checksum after the result
+	cipherBuff = arenaGet(2 * ((size_t)size + 1) + 4);
+	if (cipherBuff == NULL)
+		overBudget(connFD, size, replyVersion == 2);
+	keyBuff = cipherBuff + size + 1;
+
+	// tracks if we have read the whole msg
+	int readTotal = 0;
+	int toRead = size;
+
+	// get the cipher text
+	while (toRead > 0){
+		charsRead = recvTimed(connFD, cipherBuff + readTotal, toRead); 
+		if (charsRead <= 0) {
+			error("ERROR reading msg from socket");
+		}
 
-	// for each child processes
-	for (i = 0; i < pidCount; i++){
-		kill(pidArray[i], SIGTERM);
+		readTotal += charsRead;
+		toRead -= charsRead;
+	}
+	bytesIn = readTotal;
+
+	// discard sentinel, v1 only
+	if (replyVersion == 1 && recvTimed(connFD, buffer, 1) <= 0) {
+		error("ERROR reading msg from socket");
+	}
+	markPhase(PH_PAYLOAD);
+
+	// reset trackers
+	readTotal = 0;
+	toRead = size;
+	
+	// get the key text
+	while (toRead > 0){
+		charsRead = recvTimed(connFD, keyBuff + readTotal, toRead);
+		if (charsRead <= 0) {
+			error("ERROR reading key from socket");
+		}
+
+		readTotal += charsRead;
+		toRead -= charsRead;
+	}	
+	bytesIn += readTotal;
+	markPhase(PH_KEY);
+
+	// a checksummed request must match its CRC32C before it is used
+	if (replyFlags & V2_FLAG_CRC){
+		if (recvAll(connFD, (char*)&crc, 4) < 4)
+			error("ERROR reading checksum from socket");
+		if (ntohl(crc) != crc32c(crc32c(0, cipherBuff, size), keyBuff, size)){
+			STAT_ADD(checksumErrors, 1);
+			sendReply(connFD, V2_BAD_CHECKSUM, 0);
+			trace.size = size;
+			trace.status = "checksum";
+			emitTrace(&trace);
+			exit(1);
+		}
+	}
+
+	// decrypt the message
+	if (replyFlags & V2_FLAG_BYTES)
+		xorMsg(cipherBuff, keyBuff, size);
+	else if (decryptMsg(cipherBuff, keyBuff, size,
+			&alphabets[V2_ALPHABET(replyFlags)]) < 0)
+		badSymbols(connFD, size, replyVersion == 2);
+	markPhase(PH_CIPHER);
+		
+	// send decrypted msg back to client, zero copy when it is large
+	// the checksum goes out with the result, over the used up key
+	if (replyFlags & V2_FLAG_CRC){
+		crc = htonl(crc32c(0, cipherBuff, size));
+		memcpy(cipherBuff + size, &crc, 4);
 	}
+	if (replyVersion == 2)
+		sendReply(connFD, V2_OK, size);
+	arena.zcSeq = sendResult(connFD, cipherBuff,
+			size + ((replyFlags & V2_FLAG_CRC) ? 4 : 0));
+	corkReply(connFD, 0);
+	markPhase(PH_SEND);
+
+	// one request done, publish its totals
+	STAT_ADD(requests, 1);
+	STAT_ADD(bytesIn, bytesIn);
+	STAT_ADD(bytesOut, size);
+	STAT_ADD(sizeHist[histBucket(size)], 1);
+	STAT_ADD(sizeSum, size);
+	trace.size = size;
+	trace.status = "goods";
+
+	// done with the buffer, an oversized one is freed
+	arenaPut();
 }
 
 
 
 
 /*******************************************************************************
- * reapBG
- * should be used after killBG. Loops through array of background process ids
- * and because they should all be killed, proceedes to reap them.
+ * serveConnection
+ * runs in the forked child. Keeps reading designators and serving requests
+ * until the client hangs up between requests, so a client can send many
+ * requests back to back on one connection. Then waits for the send buffer
+ * to drain, closes the connection and exits.
  *
  * ****************************************************************************/
-void reapBG(){
-	int i;         // for looping
-	int childExit;  // stores result of how child exited
+void serveConnection(int connFD){
+	char designator[2];   // the client's send flag
+	int charsRead;
+	int status;           // whether the request may go ahead
+	int size;             // v2 message length, -1 for v1
+	int served = 0;       // requests completed on this connection
+	struct timespec now;  // realtime stamp for the trace
+
+	// count ourselves as busy until we exit
+	STAT_ADD(activeWorkers, 1);
+	atexit(workerDone);
+	atexit(flushTrace);
+	atexit(memDone);
+
+	// a client hanging up mid reply ends us through exit, so the atexit
+	// handlers still run
+	struct sigaction ignore = {0};
+	ignore.sa_handler = SIG_IGN;
+	sigaction(SIGPIPE, &ignore, NULL);
+
+	// SIGTERM kills a worker outright; the parent's stop and reload
+	// handling is not ours. SIGUSR1 (finishUp) is inherited from the parent
+	// so it is never missed, and is let through along with the rest.
+	ignore.sa_handler = SIG_DFL;
+	sigaction(SIGTERM, &ignore, NULL);
+	sigaction(SIGHUP, &ignore, NULL);
+	sigprocmask(SIG_SETMASK, &acceptMask, NULL);
+	resetTrace(&trace);
+	trace.startNs = acceptNs;
+	tuneConnection(connFD);
+
+	// keep serving until the client hangs up
+	while (1){
+		phaseMark = nowNs();
+		memset(designator, '\0', sizeof(designator));
+		replyVersion = 1;
+		replyFlags = 0;
+		setDeadline(handshakeMs, served > 0);
+		quickAck(connFD);
+
+		// Read the client's send flag from the socket
+		charsRead = recvFirst(connFD, designator, served == 0);
+
+		// idle time between requests is not part of the handshake
+		if (served > 0)
+			phaseMark = nowNs();
+
+		// a clean hang up between requests ends the connection
+		if (charsRead == 0 && served > 0)
+			break;
+		if (charsRead <= 0) {
+			STAT_ADD(handshakeFails, 1);
+			if (charsRead < 0)
+				error("ERROR reading from socket");
+			exit(1);
+		}
 
-	// for each unreaped process
-	for (i = 0; i < pidCount; i++){
-		waitpid(pidArray[i], childExit, 0);
+		// the previous request is complete, trace it
+		if (trace.status != NULL){
+			emitTrace(&trace);
+			clock_gettime(CLOCK_REALTIME, &now);
+			trace.startNs = (long long)now.tv_sec * 1000000000LL +
+				now.tv_nsec;
+		}
+
+		// stats request, report and hang up
+		if (strcmp(designator, "S") == 0){
+			sendStats(connFD);
+			break;
+		}
+
+		// multiplexed connection, the real designator follows
+		if (strcmp(designator, "M") == 0 && served == 0){
+			if (recvAll(connFD, designator, 1) == 1 &&
+					strcmp(designator, "D") == 0){
+				serveMux(connFD);
+				break;
+			}
+		}
+
+		// streamed request, the real designator follows
+		if (strcmp(designator, "C") == 0){
+			if (recvAll(connFD, designator, 1) == 1 &&
+					strcmp(designator, "D") == 0){
+				serveStream(connFD);
+				served++;
+				continue;
+			}
+		}
+
+		// a v2 header, or a plain v1 request
+		size = -1;
+		if ((unsigned char)designator[0] == V2_MAGIC >> 8){
+			replyVersion = 2;
+			status = recvHeader(connFD, designator[0], &size);
+		}
+		else if (strcmp(designator, "D") != 0)
+			status = V2_REJECTED;
+		else
+			status = V2_OK;
+
+		if (status != V2_OK)
+			refuseRequest(connFD, status);
+
+		serveRequest(connFD, size);
+		served++;
 	}
+
+	// wait for send buffer to clear, checking every millisecond, for no
+	// longer than the client was given to take the last send; a client
+	// that reset the connection leaves the count where it was, so stop
+	// once the socket reports the hang up
+	struct timespec pause = { 0, 1000000 };
+	struct pollfd gone = { connFD, 0, 0 };
+	int checkSend = -5;
+	while (1){
+		if (ioctl(connFD, TIOCOUTQ, &checkSend) < 0)
+			error("ioctl error");
+		if (checkSend == 0)
+			break;
+		if (poll(&gone, 1, 0) > 0 &&
+				(gone.revents & (POLLERR | POLLHUP)))
+			break;
+		if (sendTimeLeft() == 0)
+			timedOut();
+		nanosleep(&pause, NULL);
+	}
+	markPhase(PH_DRAIN);
+	if (trace.status != NULL)
+		emitTrace(&trace);
+
+	// Close the childs socket 	
+	close(connFD); 
+	exit(0);
 }
 
 
 
 
 /*******************************************************************************
- * reapProc
- * called on receipt of a SIGTERM signal, kills off remaining child processes
- * and then reaaps them.
+ * activationFD
+ * socket activation, as systemd and otp_launch do it: LISTEN_FDS listening
+ * sockets are passed from fd 3 up to the process LISTEN_PID names, and we
+ * serve the first. The variables are cleared so nothing we exec takes
+ * them for its own. Returns -1 when no socket was passed.
  *
  * ****************************************************************************/
-void reapProc(){
-	killBG();
-	reapBG();
-	exit(1);
+int activationFD(){
+	char* fds = getenv("LISTEN_FDS");
+	char* pid = getenv("LISTEN_PID");
+	int found = -1;
+
+	if (fds != NULL && pid != NULL && atoi(fds) >= 1 &&
+			atol(pid) == (long)getpid())
+		found = 3;
+	unsetenv("LISTEN_FDS");
+	unsetenv("LISTEN_PID");
+	unsetenv("LISTEN_FDNAMES");
+	return(found);
 }
 
 
+
+
 /*******************************************************************************
  * main
  * main checks passed in arguments and then attempts to open a connection
@@ -240,35 +3098,142 @@ void reapProc(){
  * ****************************************************************************/
 int main(int argc, char *argv[])
 {
-	int listenSocketFD, estabConnFD, portNumber, charsRead;
+	int listenSocketFD, estabConnFD, portNumber;
 	socklen_t sizeOfClientInfo;
 	struct sockaddr_in serverAddress, clientAddress;
 	
-	char buffer[11];    // to determine the length of cipher and key msgs
 	pid_t spawnPid;     // forked child process id
-	char* cipherBuff;    // will hold cipher text msg from client
-	char* keyBuff;      // will hold key text msg form client
-	char* tempBuff;     // will hold msg segments
-
-
-
-	// to handle killall signal from grading script
+	struct timespec acceptTime;      // realtime stamp taken at accept
+	int opt;                         // current command line option
+	int on = 1;                      // for setsockopt
+	int inheritFD = -1;              // -f: listening socket already open
+	cpu_set_t acceptCPUs;            // -a
+	int pinAccept = 0;               // -a was given
+	fd_set acceptSet;                // the listening socket, for pselect
+	struct timespec acceptBackoff = { 0, 100000000 };  // out of fds
+	sigset_t stopSignals;            // SIGTERM and SIGHUP
+	socklen_t onLen = sizeof(on);
+	struct option longOpts[] = {     // --fd is -f
+		{"fd", required_argument, NULL, 'f'},
+		{NULL, 0, NULL, 0}
+	};
+
+
+
+	// to handle killall signal from grading script, and reloads
 	struct sigaction SIGTERM_action = {0};
 
 	// fill the struct
-	SIGTERM_action.sa_handler = reapProc;
+	SIGTERM_action.sa_handler = requestStop;
 	sigfillset(&SIGTERM_action.sa_mask);
 	SIGTERM_action.sa_flags = 0;
 
-	// register the struct to the signal
+	// register the struct to the signals
 	sigaction(SIGTERM, &SIGTERM_action, NULL);
+	sigaction(SIGHUP, &SIGTERM_action, NULL);
+	// a worker told to finish up carries on with any read it is in
+	SIGTERM_action.sa_handler = finishUp;
+	SIGTERM_action.sa_flags = SA_RESTART;
+	sigaction(SIGUSR1, &SIGTERM_action, NULL);
+
+	// stop requests are only taken while waiting for a connection
+	sigemptyset(&stopSignals);
+	sigaddset(&stopSignals, SIGTERM);
+	sigaddset(&stopSignals, SIGHUP);
+	sigprocmask(SIG_BLOCK, &stopSignals, &acceptMask);
+	sigdelset(&acceptMask, SIGTERM);
+	sigdelset(&acceptMask, SIGHUP);
+	savedArgc = argc;
+	savedArgv = argv;
+	saveStartPath(argv[0]);
+	sched_getaffinity(0, sizeof(startCPUs), &startCPUs);
+	memBudget = defaultBudget();
 
 
 
 
 	// Check usage & args
-	if (argc < 2 || argc > 2) { 
-		fprintf(stderr,"USAGE: %s port\n", argv[0]); 
+	while ((opt = getopt_long(argc, argv, "t:m:c:M:w:r:T:f:a:A:N:Z:P:",
+					longOpts, NULL)) != -1){
+		switch (opt){
+			// -t tracefile: write a JSON line per request
+			case 't':
+				openTrace(optarg);
+				break;
+			// -m threads: workers per multiplexed connection
+			case 'm':
+				muxThreads = atoi(optarg);
+				if (muxThreads < 1)
+					muxThreads = 1;
+				break;
+			// -c bytes: largest buffer a worker keeps for reuse
+			case 'c':
+				arenaChunk = parseSize(optarg);
+				break;
+			// -M bytes: memory budget for all request buffers
+			case 'M':
+				memBudget = parseSize(optarg);
+				break;
+			// -w workers: connections served at once
+			case 'w':
+				maxWorkers = atol(optarg);
+				break;
+			// -r ms: wait suggested to clients turned away
+			case 'r':
+				retryMs = atoi(optarg);
+				break;
+			// -T ms:ms:rate: handshake and header deadlines, and the
+			// slowest payload rate in bytes a second
+			case 'T':
+				sscanf(optarg, "%d:%d:%ld", &handshakeMs, &headerMs,
+						&minRate);
+				break;
+			// -f/--fd fd: serve an already listening socket
+			case 'f':
+				inheritFD = atoi(optarg);
+				break;
+			// -a cpus: where the accepting parent runs
+			case 'a':
+				parseCPUs(optarg, &acceptCPUs);
+				pinAccept = 1;
+				break;
+			// -A cpus / -N nodes: where workers run, round robin
+			case 'A':
+				placeOnCPUs(optarg);
+				break;
+			case 'N':
+				placeOnNodes(optarg);
+				break;
+			// -Z bytes: smallest result sent zero copy, 0 for never
+			case 'Z':
+				zcThreshold = parseSize(optarg);
+				break;
+			// -P tuning: socket options, a profile and/or name=value
+			case 'P':
+				parseTuning(optarg);
+				break;
+			default:
+				fprintf(stderr,"USAGE: %s [-t tracefile] "
+					"[-m threads] [-c chunk] [-M budget] "
+					"[-w workers] [-r ms] [-T hs:hdr:rate] "
+					"[-a cpus] [-A cpus | -N nodes] [-Z bytes] "
+					"[-P tuning] [-f fd] port\n", argv[0]);
+				exit(1);
+		}
+	}
+	// a socket handed over by a supervisor needs no port
+	if (inheritFD < 0)
+		inheritFD = activationFD();
+	// pinned only now, so -A and -N were checked against every CPU
+	if (pinAccept){
+		checkPlacement(&acceptCPUs);
+		placeSelf(&acceptCPUs, -1);
+	}
+	if (argc - optind != 1 && !(inheritFD >= 0 && argc == optind)) { 
+		fprintf(stderr,"USAGE: %s [-t tracefile] [-m threads] [-c chunk] "
+				"[-M budget] [-w workers] [-r ms] [-T hs:hdr:rate] "
+				"[-a cpus] [-A cpus | -N nodes] [-Z bytes] "
+				"[-P tuning] [-f fd] port\n", argv[0]); 
 		exit(1); 
 	} 
 
@@ -277,7 +3242,7 @@ int main(int argc, char *argv[])
 	memset((char *)&serverAddress, '\0', sizeof(serverAddress)); 
 	
 	// Get the port number, convert to an integer from a string
-	portNumber = atoi(argv[1]); 
+	portNumber = optind < argc ? atoi(argv[optind]) : 0; 
 
 	// validate port number
 	if (portNumber < 0 || portNumber > 65535){
@@ -294,24 +3259,58 @@ int main(int argc, char *argv[])
 	// Any address is allowed for connection to this process
 	serverAddress.sin_addr.s_addr = INADDR_ANY; 
 
-	// Set up the socket
-	listenSocketFD = socket(AF_INET, SOCK_STREAM, 0); 
-	if (listenSocketFD < 0) {
-		error("ERROR opening socket");
+	// Set up the socket, or take over the one we were handed
+	if (inheritFD >= 0){
+		listenSocketFD = inheritFD;
+		if (getsockopt(listenSocketFD, SOL_SOCKET, SO_ACCEPTCONN, &on,
+					&onLen) < 0 || !on){
+			fprintf(stderr, "ERROR: fd %d is not a listening socket\n",
+					listenSocketFD);
+			exit(1);
+		}
+		on = 1;
+
+		// the tuning applies all the same, except the backlog, which
+		// was set by whoever opened the socket
+		tuneListener(listenSocketFD);
+	}
+	else {
+		listenSocketFD = socket(AF_INET, SOCK_STREAM, 0); 
+		if (listenSocketFD < 0) {
+			error("ERROR opening socket");
+		}
+
+		// Enable the socket to begin listening
+		// Connect socket to port
+		if (bind(listenSocketFD, (struct sockaddr *)&serverAddress, 
+					sizeof(serverAddress)) < 0) 
+			error("ERROR on binding");
+
+		// Flip the socket on - it can now receive up to 5 connections,
+		// or the tuned backlog (a socket handed over keeps its own)
+		tuneListener(listenSocketFD);
+		listen(listenSocketFD, tune.backlog); 
 	}
 
-	// Enable the socket to begin listening
-	// Connect socket to port
-	if (bind(listenSocketFD, (struct sockaddr *)&serverAddress, 
-				sizeof(serverAddress)) < 0) 
-		error("ERROR on binding");
+	// another daemon may share the socket, during a reload or under
+	// otp_launch, and take the connection pselect woke us for; accept
+	// must then fail instead of blocking with stop requests held off
+	fcntl(listenSocketFD, F_SETFL,
+			fcntl(listenSocketFD, F_GETFL) | O_NONBLOCK);
 	
-	// Flip the socket on - it can now receive up to 5 connections
-	listen(listenSocketFD, 5); 
+	// when tracing, have the kernel stamp arriving data so the accept
+	// queue wait can be measured. Accepted sockets inherit the option.
+	if (traceFD >= 0)
+		setsockopt(listenSocketFD, SOL_SOCKET, SO_TIMESTAMPNS, &on,
+				sizeof(on));
 	//printf("listening for connections\n");
 
 	// Get the size of the address for the client that will connect
 	sizeOfClientInfo = sizeof(clientAddress);
+
+	// shared counters must exist before the first child is forked
+	initStats();
+	initAlphabets();
 	
 	// Accept a connection, blocking if one not available until one connects
 	// always try to open up incoming connections
@@ -319,13 +3318,46 @@ int main(int argc, char *argv[])
 		// check for any finished background processes
 		reapChildren();
 
+		// asked to stop or reload, this does not return unless a
+		// reload failed
+		if (stopRequested)
+			shutDown(listenSocketFD);
+
+		// wait for a connection with stop requests let through
+		FD_ZERO(&acceptSet);
+		FD_SET(listenSocketFD, &acceptSet);
+		if (pselect(listenSocketFD + 1, &acceptSet, NULL, NULL, NULL,
+					&acceptMask) < 0){
+			if (errno == EINTR)
+				continue;
+			error("ERROR waiting for connections");
+		}
+
 		// Accept the connection
 		estabConnFD = accept(listenSocketFD, 
 				(struct sockaddr *)&clientAddress, 
 				&sizeOfClientInfo); 
 		if (estabConnFD < 0) {
+			// taken by another daemon on the socket, or the client
+			// gave up before we got to it: wait again
+			if (errno == EAGAIN || errno == EWOULDBLOCK ||
+					errno == EINTR || errno == ECONNABORTED ||
+					errno == EPROTO)
+				continue;
+
+			// out of descriptors or buffers for now: back off with
+			// stop requests let through, and try again
+			if (errno == EMFILE || errno == ENFILE ||
+					errno == ENOBUFS || errno == ENOMEM){
+				perror("SERVER: accept");
+				pselect(0, NULL, NULL, NULL, &acceptBackoff,
+						&acceptMask);
+				continue;
+			}
 			error("ERROR on accept");
 		}
+		STAT_ADD(connAccepted, 1);
+		clock_gettime(CLOCK_REALTIME, &acceptTime);
 		//printf("connection accepted\n");
 
 		// fork off a new process to handle encription
@@ -341,150 +3373,10 @@ int main(int argc, char *argv[])
 			// handle child process
 			case 0:
 				//printf("in child process\n");
-				// reset the buffer
-				memset(buffer, '\0', sizeof(buffer));
-		
-				// Read the client's send flag from the socket
-				charsRead = recv(estabConnFD, buffer, 1, 0);	
-				if (charsRead < 0) {
-					error("ERROR reading from socket");
-				}
-	
-				//printf("SERVER: rec from the client: \"%s\"\n",
-				//		buffer);
-				if (strcmp(buffer, "D") != 0){
-					// send err back to client
-					send(estabConnFD, "error", 5, 0);
-					//error("SERVER: connection not allowed");
-					exit(1);
-				}
-	
-				// Send a Success message back to the client
-				charsRead = send(estabConnFD, "goods", 5, 0); 
-				if (charsRead < 0) {
-					error("ERROR writing to socket");
-				}
-
-				//printf("SERVER: connection good\n");
-
-				// get the size of the messages
-				charsRead = recv(estabConnFD, buffer, 10, 0);
-				if (charsRead < 0) {
-					error("ERROR reading msg size");
-				}
-				//printf("SERVER: msg size is %s\n", buffer);
-
-				// change string val to int
-				int size = atoi(buffer);
-				//printf("SERVER: each msg size: ..%d..\n", size);
-
-				
-				
-				// create buffers for holding cipher and key text
-				cipherBuff = calloc(size + 1, sizeof(char));	
-				keyBuff = calloc(size + 1, sizeof(char));
-				tempBuff = calloc(size + 1, sizeof(char));
-				
-
-				// tracks if we have read the whole msg
-				int readTotal = 0;
-				int toRead = size;
-
-				// get the cipher text
-				while (readTotal < toRead){
-					charsRead = recv(estabConnFD, 
-						tempBuff, toRead, 0); 
-					
-					// concat the msg segment
-					strcat(cipherBuff, tempBuff);
-					// reset the tempBuff
-					memset(tempBuff, '\0', size + 1);
-
-					readTotal += charsRead;
-					toRead -= charsRead;
-				}
-				//printf("SERVER: cipher is: %s\n", cipherBuff);
-				//printf("SERVER: cipher is %d bytes\n", strlen(cipherBuff));
-
-				// discard sentinel
-				charsRead = recv(estabConnFD, buffer, 1, 0); 
-				
-				
-				// reset trackers
-				readTotal = 0;
-				toRead = size;
-				memset(tempBuff, '\0', size + 1);
-				
-				// get the key text
-				while (readTotal < toRead){
-					charsRead = recv(estabConnFD, 
-						keyBuff, size, 0);
-					
-					// concat the msg segment
-					strcat(keyBuff, tempBuff);
-					// reset the tempBuff
-					memset(tempBuff, '\0', size + 1);
-
-					readTotal += charsRead;
-					toRead -= charsRead;
-				}	
-				//printf("SERVER: key is: %s\n", keyBuff);
-				//printf("SERVER: key is %d bytes\n", strlen(keyBuff));
-
-
-
-				// decrypt the message
-				decryptMsg(cipherBuff, keyBuff, size);
-				//printf("SERVER: plaintext is: %s\n", cipherBuff);
-				//printf("SERVER: plaintext is %d bytes\n", strlen(cipherBuff));
-
-					
-				// tracks if we sent whole msg
-				int totalSent = 0;
-				int toSend = size;
-
-				// send decrypted msg back to client
-				while (totalSent < size){
-					charsRead = send(estabConnFD, 
-						(cipherBuff + totalSent),
-					       	toSend, 0);	
-					if (charsRead < 0) {
-						error("ERROR writing plaintextto socket");
-					}
-					
-					totalSent += charsRead;
-					toSend -= charsRead;
-				}
-				//printf("SERVER sent plain: %d bytes\n", charsRead);
-
-
-
-				// wait for send buffer to clear
-				int checkSend = -5;
-				do{
-					ioctl(estabConnFD, TIOCOUTQ, &checkSend);
-				} while (checkSend > 0);
-
-				if (checkSend < 0)
-					error("ioctl error");
-
-
-
-
-				// free buff memory
-				if (cipherBuff){
-					free(cipherBuff);
-				}
-				if (keyBuff){
-					free(keyBuff);
-				}
-				if (tempBuff){
-					free(tempBuff);
-				}
-
-				// Close the childs socket 	
-				close(estabConnFD); 
-				exit(1);
+				acceptNs = (long long)acceptTime.tv_sec * 1000000000LL
+					+ acceptTime.tv_nsec;
+				placeWorker();
+				serveConnection(estabConnFD);
 				break;
 
 			// handle parent process
@@ -495,6 +3387,9 @@ int main(int argc, char *argv[])
 				// track the spawned processes for reaping
 				addPid(spawnPid);
 
+				// the next connection gets the next placement
+				placeNext++;
+
 				// parent loops back to top of while
 				break;
 		}
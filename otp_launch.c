@@ -0,0 +1,285 @@
+/*******************************************************************************
+ * otp_launch.c
+ * Usage: otp_launch [-l] [-r] <port> <daemon> [daemon args...] &
+ * Description - A small stand in for systemd socket activation. Binds and
+ * listens on port itself, then runs the daemon with the listening socket
+ * as fd 3 and LISTEN_FDS=1 / LISTEN_PID set, so the daemon serves it
+ * instead of opening its own. Because the launcher holds the socket,
+ * connections that arrive while the daemon is starting or restarting wait
+ * in the backlog instead of being refused.
+ *   -l  lazy: start the daemon only when the first connection arrives
+ *   -r  restart the daemon (lazily with -l) whenever it fails
+ * SIGHUP starts a new daemon on the socket and asks the old one to drain
+ * (SIGTERM); SIGTERM and SIGINT are passed to the daemon, and the launcher
+ * exits once it has.
+ *
+ * ****************************************************************************/
+
+#define _GNU_SOURCE     // ppoll
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <signal.h>
+#include <sys/wait.h>
+#include <poll.h>
+#include <time.h>
+#include <errno.h>
+
+
+
+#define ACTIVATION_FD 3      // where socket activation puts the first socket
+
+
+
+volatile sig_atomic_t stopping = 0;     // SIGTERMs and SIGINTs seen
+volatile sig_atomic_t reloading = 0;    // SIGHUP seen
+pid_t daemonPid = 0;                    // the daemon serving now, 0 if none
+sigset_t waitMask;      // the signal mask to wait with, the one we started
+                        // with; the signals below are blocked otherwise
+
+
+
+// Error function used for reporting issues
+void error(const char *msg) {
+	perror(msg);
+	exit(1);
+}
+
+
+
+
+/*******************************************************************************
+ * onSignal
+ * notes a stop or reload for main to act on. SIGHUP, SIGTERM, SIGINT and
+ * SIGCHLD are blocked except while main waits, in ppoll or sigsuspend, so
+ * each is seen by the checks that follow the wait and none can slip in
+ * between a check and the wait; SIGCHLD only ends the wait.
+ *
+ * ****************************************************************************/
+void onSignal(int sig){
+	if (sig == SIGHUP)
+		reloading = 1;
+	else if (sig != SIGCHLD)
+		stopping++;
+}
+
+
+
+
+/*******************************************************************************
+ * listenOn
+ * opens, binds and listens on port, with the largest backlog the kernel
+ * allows so a daemon that is still starting loses nothing.
+ *
+ * ****************************************************************************/
+int listenOn(int port){
+	struct sockaddr_in serverAddress;
+	int listenFD;
+	int on = 1;
+
+	memset((char *)&serverAddress, '\0', sizeof(serverAddress));
+	serverAddress.sin_family = AF_INET;
+	serverAddress.sin_port = htons(port);
+	serverAddress.sin_addr.s_addr = INADDR_ANY;
+
+	listenFD = socket(AF_INET, SOCK_STREAM, 0);
+	if (listenFD < 0)
+		error("ERROR opening socket");
+	setsockopt(listenFD, SOL_SOCKET, SO_REUSEADDR, &on, sizeof(on));
+	if (bind(listenFD, (struct sockaddr *)&serverAddress,
+				sizeof(serverAddress)) < 0)
+		error("ERROR on binding");
+	if (listen(listenFD, SOMAXCONN) < 0)
+		error("ERROR on listen");
+	return(listenFD);
+}
+
+
+
+
+/*******************************************************************************
+ * startDaemon
+ * forks and execs the daemon with listenFD as fd 3 and the socket
+ * activation variables naming it. Returns the daemon's pid.
+ *
+ * ****************************************************************************/
+pid_t startDaemon(int listenFD, char** args){
+	char pidText[16];   // LISTEN_PID
+	pid_t pid;
+
+	pid = fork();
+	if (pid < 0)
+		error("ERROR forking daemon");
+	if (pid > 0)
+		return(pid);
+
+	if (listenFD != ACTIVATION_FD){
+		if (dup2(listenFD, ACTIVATION_FD) < 0)
+			error("ERROR passing socket");
+		close(listenFD);
+	}
+	sigprocmask(SIG_SETMASK, &waitMask, NULL);
+	sprintf(pidText, "%ld", (long)getpid());
+	setenv("LISTEN_FDS", "1", 1);
+	setenv("LISTEN_PID", pidText, 1);
+	execvp(args[0], args);
+	fprintf(stderr, "otp_launch: cannot run %s: %s\n", args[0],
+			strerror(errno));
+	_exit(127);
+}
+
+
+
+
+/*******************************************************************************
+ * waitConnection
+ * lazy start: waits until a connection is queued on listenFD, with signals
+ * let through. Returns -1 if a signal came first.
+ *
+ * ****************************************************************************/
+int waitConnection(int listenFD){
+	struct pollfd pfd;
+
+	pfd.fd = listenFD;
+	pfd.events = POLLIN;
+	if (ppoll(&pfd, 1, NULL, &waitMask) < 0){
+		if (errno == EINTR)
+			return(-1);
+		error("ERROR waiting for connections");
+	}
+	return(0);
+}
+
+
+
+
+/*******************************************************************************
+ * main
+ * holds the listening socket and keeps a daemon serving it: started at once
+ * or on the first connection, replaced on SIGHUP, restarted with -r when
+ * it fails, until it exits cleanly or we are told to stop.
+ *
+ * ****************************************************************************/
+int main(int argc, char* argv[]){
+	int lazy = 0;          // -l
+	int restart = 0;       // -r
+	int listenFD, port, opt, status;
+	int stopsSent = 0;     // stops passed on to the daemon
+	pid_t pid, old;
+	time_t startedAt = 0;  // when the current daemon was started
+	struct sigaction act = {0};
+	sigset_t launchSignals;   // blocked but while waiting
+
+	// stop at the daemon's name, its options are its own
+	while ((opt = getopt(argc, argv, "+lr")) != -1){
+		switch (opt){
+			case 'l':
+				lazy = 1;
+				break;
+			case 'r':
+				restart = 1;
+				break;
+			default:
+				fprintf(stderr, "USAGE: %s [-l] [-r] port daemon "
+						"[args...]\n", argv[0]);
+				exit(1);
+		}
+	}
+	if (argc - optind < 2){
+		fprintf(stderr, "USAGE: %s [-l] [-r] port daemon [args...]\n",
+				argv[0]);
+		exit(1);
+	}
+	port = atoi(argv[optind]);
+	if (port < 0 || port > 65535){
+		fprintf(stderr, "ERROR: port number out of range\n");
+		exit(1);
+	}
+	listenFD = listenOn(port);
+
+	// the signals are only taken while waiting, see onSignal
+	sigemptyset(&launchSignals);
+	sigaddset(&launchSignals, SIGHUP);
+	sigaddset(&launchSignals, SIGTERM);
+	sigaddset(&launchSignals, SIGINT);
+	sigaddset(&launchSignals, SIGCHLD);
+	sigprocmask(SIG_BLOCK, &launchSignals, &waitMask);
+	act.sa_handler = onSignal;
+	sigfillset(&act.sa_mask);
+	sigaction(SIGHUP, &act, NULL);
+	sigaction(SIGTERM, &act, NULL);
+	sigaction(SIGINT, &act, NULL);
+	sigaction(SIGCHLD, &act, NULL);
+
+	while (!stopping){
+		if (daemonPid == 0){
+			// with no daemon running there is nothing to reload, the
+			// next one started runs the new binary anyway
+			if (lazy && waitConnection(listenFD) < 0){
+				reloading = 0;
+				continue;
+			}
+
+			// a daemon that keeps failing at once is not spun on
+			if (time(NULL) - startedAt < 1)
+				sleep(1);
+			startedAt = time(NULL);
+			daemonPid = startDaemon(listenFD, &argv[optind + 1]);
+		}
+
+		// replace the daemon, the old one finishes what it has
+		if (reloading){
+			reloading = 0;
+			old = daemonPid;
+			daemonPid = startDaemon(listenFD, &argv[optind + 1]);
+			startedAt = time(NULL);
+			kill(old, SIGTERM);
+		}
+
+		// collect a daemon that has exited, or wait for one to, or for
+		// a signal
+		pid = waitpid(-1, &status, WNOHANG);
+		if (pid < 0)
+			error("ERROR waiting for daemon");
+		if (pid == 0){
+			sigsuspend(&waitMask);
+			continue;
+		}
+
+		// an old daemon has drained
+		if (pid != daemonPid)
+			continue;
+		daemonPid = 0;
+
+		// a clean exit is the daemon's own choice (a stop, or a reload
+		// it handed to its own successor)
+		if (WIFEXITED(status) && WEXITSTATUS(status) == 0)
+			break;
+		fprintf(stderr, "otp_launch: %s failed\n", argv[optind + 1]);
+		if (!restart)
+			exit(1);
+	}
+
+	// pass each stop on (a second one makes the daemon kill its workers)
+	// and let every daemon we started finish
+	while (1){
+		for (; stopsSent < stopping; stopsSent++){
+			if (daemonPid > 0)
+				kill(daemonPid, SIGTERM);
+		}
+		pid = waitpid(-1, &status, WNOHANG);
+		if (pid < 0)
+			break;
+		if (pid == 0){
+			sigsuspend(&waitMask);
+			continue;
+		}
+		if (pid == daemonPid)
+			daemonPid = 0;
+	}
+	return(0);
+}
@@ -0,0 +1,923 @@
+/*******************************************************************************
+ * otp_load.c
+ * Usage: otp_load [-R rate [-P] | -c connections] [-d seconds] [-w seconds]
+ *        [-x encShare] [-s sizes] [-e us] [-n] [-o histfile] [-V version]
+ *        [-C] [-b | -a alphabet] <encPort> [decPort]
+ * Description - Load generator for otp_enc_d and otp_dec_d. Drives the
+ * daemons either open loop, starting requests at a fixed arrival rate (-R,
+ * evenly spaced or with -P as a Poisson process) no matter how far behind
+ * the daemon falls, or closed loop, keeping a fixed number of requests in
+ * flight (-c) back to back; with -R, -c caps the requests in flight
+ * (default 4096). Requests are a mix of encryptions and decryptions (-x,
+ * the share sent to encPort) of random text whose sizes follow -s. Latency
+ * is recorded in an HDR style histogram. Requests use protocol v2 unless
+ * -V 1 asks for the v1 exchange; -C adds CRC32C checksums to v2 requests
+ * and checks the results', and a result that fails counts as failed; -b
+ * asks for the binary pad mode, XOR in place of the alphabet, and -a for
+ * text in one of the daemons' other alphabets.
+ *
+ * Coordinated omission: an open loop request is timed from when it was
+ * due, not from when it could be sent, so time it spent queued behind a
+ * stalled daemon is counted. The "service" row is timed from the send for
+ * comparison. In closed loop, -e gives the interval each connection was
+ * expected to issue requests at; a request that took longer also records
+ * the requests that would have been sent meanwhile, HdrHistogram style.
+ *
+ * ****************************************************************************/
+
+#define _GNU_SOURCE     // ppoll
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <endian.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#include <sys/uio.h>
+#include <sys/prctl.h>
+#include <poll.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <math.h>
+#include <time.h>
+
+#include "alphabets.h"
+#include "protocol.h"
+
+
+
+#define HIST_SUB_BITS 7                    // 128 linear steps per doubling
+#define HIST_SUB (1 << HIST_SUB_BITS)      // so values are within 1%
+#define HIST_HALF (HIST_SUB / 2)
+#define HIST_BUCKETS (HIST_SUB + 48 * HIST_HALF)   // up to ~2^54 us
+#define MAX_SIZES 16                       // entries in a -s mix
+#define DRAIN_US 5000000LL                 // time allowed after the run
+#define SINK_SIZE 65536                    // results are read and dropped
+
+
+
+// Error function used for reporting issues
+void error(const char *msg) {
+	perror(msg);
+	exit(1);
+}
+
+
+
+
+/*******************************************************************************
+ * histogram
+ * log-linear latency histogram in microseconds: values below HIST_SUB have
+ * a bucket each, above that every power of two is split into HIST_HALF
+ * equal buckets, so any value is kept to within 1/HIST_HALF.
+ *
+ * ****************************************************************************/
+struct histogram {
+	long long counts[HIST_BUCKETS];
+	long long total;    // values recorded
+	long long max;      // largest exact value
+};
+
+
+
+
+/*******************************************************************************
+ * histIndex
+ * the bucket value v is counted in.
+ *
+ * ****************************************************************************/
+int histIndex(long long v){
+	int shift;   // bits dropped, so v >> shift lies in [HIST_HALF, HIST_SUB)
+
+	if (v < HIST_SUB)
+		return(v < 0 ? 0 : (int)v);
+	shift = 63 - __builtin_clzll(v) - (HIST_SUB_BITS - 1);
+	if (shift > 48)
+		return(HIST_BUCKETS - 1);
+	return(HIST_SUB + (shift - 1) * HIST_HALF +
+			(int)((v >> shift) - HIST_HALF));
+}
+
+
+
+
+/*******************************************************************************
+ * histValue
+ * the largest value bucket i holds, which is what percentiles report.
+ *
+ * ****************************************************************************/
+long long histValue(int i){
+	int shift;
+
+	if (i < HIST_SUB)
+		return(i);
+	shift = (i - HIST_SUB) / HIST_HALF + 1;
+	return(((long long)((i - HIST_SUB) % HIST_HALF + HIST_HALF + 1)
+				<< shift) - 1);
+}
+
+
+
+
+/*******************************************************************************
+ * histRecord
+ * counts v, and with an expected interval the values a closed loop would
+ * have seen for the requests it did not send while waiting on this one.
+ *
+ * ****************************************************************************/
+void histRecord(struct histogram* h, long long v, long long interval){
+	h->counts[histIndex(v)]++;
+	h->total++;
+	if (v > h->max)
+		h->max = v;
+	if (interval <= 0)
+		return;
+	for (v -= interval; v >= interval; v -= interval){
+		h->counts[histIndex(v)]++;
+		h->total++;
+	}
+}
+
+
+
+
+/*******************************************************************************
+ * histPercentile
+ * the value at or below which p percent of the recorded values lie.
+ *
+ * ****************************************************************************/
+long long histPercentile(struct histogram* h, double p){
+	long long want = (long long)ceil(h->total * p / 100.0);
+	long long seen = 0;
+	long long v;
+	int i;
+
+	if (want < 1)
+		want = 1;
+	for (i = 0; i < HIST_BUCKETS; i++){
+		seen += h->counts[i];
+		if (seen >= want){
+			v = histValue(i);
+			return(v < h->max ? v : h->max);
+		}
+	}
+	return(h->max);
+}
+
+
+
+
+/*******************************************************************************
+ * printPercentiles
+ * one row of the summary table.
+ *
+ * ****************************************************************************/
+void printPercentiles(const char* name, struct histogram* h){
+	double ps[] = { 50, 90, 99, 99.9, 99.99 };
+	int i;
+
+	printf("%-12s", name);
+	for (i = 0; i < 5; i++)
+		printf(" %9lld", h->total ? histPercentile(h, ps[i]) : 0);
+	printf(" %9lld\n", h->max);
+}
+
+
+
+
+/*******************************************************************************
+ * writeDistribution
+ * writes the whole distribution in the HdrHistogram percentile text format
+ * (value, percentile, count, 1/(1-percentile)) for plotting.
+ *
+ * ****************************************************************************/
+void writeDistribution(const char* path, struct histogram* h){
+	FILE* out = fopen(path, "w");
+	long long seen = 0;
+	double p;
+	int i;
+
+	if (out == NULL)
+		error("ERROR opening histogram file");
+	fprintf(out, "%12s %14s %10s %14s\n\n", "Value", "Percentile",
+			"TotalCount", "1/(1-Percentile)");
+	for (i = 0; i < HIST_BUCKETS && seen < h->total; i++){
+		if (h->counts[i] == 0)
+			continue;
+		seen += h->counts[i];
+		p = (double)seen / h->total;
+		if (p < 1.0)
+			fprintf(out, "%12.3f %14.12f %10lld %14.2f\n",
+					histValue(i) / 1000.0, p, seen, 1 / (1 - p));
+		else
+			fprintf(out, "%12.3f %14.12f %10lld\n",
+					h->max / 1000.0, p, seen);
+	}
+	fprintf(out, "#[Max = %12.3f, Total count = %12lld]\n",
+			h->max / 1000.0, h->total);
+	fclose(out);
+}
+
+
+
+
+/*******************************************************************************
+ * request
+ * one request slot. Each slot keeps a connection to each daemon alive
+ * between its requests (unless -n), as the clients do.
+ *
+ * ****************************************************************************/
+struct request {
+	int active;           // a request is in flight
+	int op;               // 0 encrypt, 1 decrypt
+	int fd;               // its connection
+	int connecting;       // waiting for a non-blocking connect
+	int keep[2];          // idle connection per daemon, -1 if none
+	int len;              // message bytes
+	char header[16];      // v2 header, or designator and 10 digit length
+	int headerLen;        // bytes in header
+	int size;             // request bytes in all
+	int sent;             // request bytes sent so far
+	int crcLen;           // 4 with -C, for the request's and result's CRC
+	uint32_t crc;         // the request's CRC32C, network byte order
+	uint32_t resultCrc;   // CRC32C of the result bytes read so far
+	char replyCrc[4];     // the result's CRC32C, as it arrives
+	long got;             // reply bytes read so far
+	char status[17];      // the daemon's reply status, or v2 header
+	int statusLen;        // bytes in status
+	long long dueUs;      // when it should have started
+	long long startUs;    // when it did
+};
+
+
+
+
+/*******************************************************************************
+ * run settings and results
+ *
+ * ****************************************************************************/
+double rate = 0;             // -R: open loop arrivals a second
+int poisson = 0;             // -P: exponential gaps between arrivals
+int numSlots = 0;            // -c: closed loop concurrency
+double duration = 10;        // -d: seconds measured
+double warmup = 0;           // -w: seconds run first and not measured
+double encShare = 0.5;       // -x: share of requests that are encryptions
+long long expectedUs = 0;    // -e: closed loop expected interval
+int fresh = 0;               // -n: new connection per request
+int version = V2_VERSION;    // -V: protocol the requests use
+int useCrc = 0;              // -C: checksum requests and results
+int binary = 0;              // -b: binary pad mode
+int alphabet = ALPHA_TEXT;   // -a: alphabet the text is written in
+int ports[2];                // enc and dec daemon ports
+
+long sizeMin[MAX_SIZES];     // -s entries: size or log-uniform range
+long sizeMax[MAX_SIZES];
+double sizeWeight[MAX_SIZES];
+int numSizes = 0;
+double totalWeight = 0;
+
+char* text;                  // random message and key bytes
+long textLen;
+
+struct histogram corrected;  // from when each request was due
+struct histogram service;    // from when each request was sent
+long long completed[2], failed, busy, late, bytesDone;
+
+
+
+
+/*******************************************************************************
+ * nowUs
+ * monotonic microseconds.
+ *
+ * ****************************************************************************/
+long long nowUs(){
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return((long long)ts.tv_sec * 1000000LL + ts.tv_nsec / 1000);
+}
+
+
+
+
+/*******************************************************************************
+ * unitRand
+ * uniform in [0, 1).
+ *
+ * ****************************************************************************/
+double unitRand(){
+	return(rand() / ((double)RAND_MAX + 1));
+}
+
+
+
+
+/*******************************************************************************
+ * parseSize
+ * reads a byte count with an optional K, M or G suffix, leaving *end after
+ * it.
+ *
+ * ****************************************************************************/
+long parseSize(const char* text, char** end){
+	long n = strtol(text, end, 10);
+
+	switch (**end){
+		case 'k': case 'K':
+			n <<= 10;
+			(*end)++;
+			break;
+		case 'm': case 'M':
+			n <<= 20;
+			(*end)++;
+			break;
+		case 'g': case 'G':
+			n <<= 30;
+			(*end)++;
+			break;
+	}
+	return(n);
+}
+
+
+
+
+/*******************************************************************************
+ * parseSizes
+ * reads the -s mix: comma separated entries of size or min-max (drawn log
+ * uniformly, so each doubling is equally likely), each with an optional
+ * :weight. e.g. "1K-64K:9,4M:1".
+ *
+ * ****************************************************************************/
+void parseSizes(char* spec){
+	char* p = spec;
+
+	numSizes = 0;
+	totalWeight = 0;
+	while (*p != '\0' && numSizes < MAX_SIZES){
+		sizeMin[numSizes] = parseSize(p, &p);
+		sizeMax[numSizes] = sizeMin[numSizes];
+		if (*p == '-')
+			sizeMax[numSizes] = parseSize(p + 1, &p);
+		sizeWeight[numSizes] = 1;
+		if (*p == ':')
+			sizeWeight[numSizes] = strtod(p + 1, &p);
+		if (sizeMin[numSizes] < 1 || sizeMax[numSizes] < sizeMin[numSizes]
+				|| sizeWeight[numSizes] <= 0 ||
+				(*p != ',' && *p != '\0')){
+			fprintf(stderr, "ERROR: bad size mix \"%s\"\n", spec);
+			exit(1);
+		}
+		totalWeight += sizeWeight[numSizes];
+		numSizes++;
+		if (*p == ',')
+			p++;
+	}
+}
+
+
+
+
+/*******************************************************************************
+ * pickSize
+ * draws a message size from the -s mix.
+ *
+ * ****************************************************************************/
+long pickSize(){
+	double w = unitRand() * totalWeight;
+	int i;
+
+	for (i = 0; i < numSizes - 1 && w >= sizeWeight[i]; i++)
+		w -= sizeWeight[i];
+	if (sizeMin[i] == sizeMax[i])
+		return(sizeMin[i]);
+	return((long)exp(log(sizeMin[i]) +
+				unitRand() * (log(sizeMax[i] + 1) - log(sizeMin[i]))));
+}
+
+
+
+
+/*******************************************************************************
+ * makeText
+ * random text in the daemons' alphabet, long enough for the largest
+ * message. Message and key are both taken from it; any such text decrypts,
+ * so decryptions need no real ciphertext.
+ *
+ * ****************************************************************************/
+void makeText(){
+	const char* symbols = alphabets[alphabet].symbols;
+	int size = strlen(symbols);
+	long i;
+
+	textLen = 0;
+	for (i = 0; i < numSizes; i++){
+		if (sizeMax[i] > textLen)
+			textLen = sizeMax[i];
+	}
+	text = malloc(textLen + 1);
+	if (text == NULL)
+		error("ERROR allocating memory");
+	for (i = 0; i < textLen; i++)
+		text[i] = symbols[rand() % size];
+}
+
+
+
+
+/*******************************************************************************
+ * connectDaemon
+ * starts a non-blocking connection to port on localhost. Returns the socket
+ * or -1, setting *pending while the connect is still in progress.
+ *
+ * ****************************************************************************/
+int connectDaemon(int port, int* pending){
+	struct sockaddr_in serverAddress;
+	int fd;
+
+	memset((char*)&serverAddress, '\0', sizeof(serverAddress));
+	serverAddress.sin_family = AF_INET;
+	serverAddress.sin_port = htons(port);
+	serverAddress.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+
+	fd = socket(AF_INET, SOCK_STREAM, 0);
+	if (fd < 0)
+		error("ERROR opening socket");
+	fcntl(fd, F_SETFL, O_NONBLOCK);
+
+	*pending = 0;
+	if (connect(fd, (struct sockaddr*)&serverAddress,
+				sizeof(serverAddress)) < 0){
+		if (errno != EINPROGRESS){
+			close(fd);
+			return(-1);
+		}
+		*pending = 1;
+	}
+	return(fd);
+}
+
+
+
+
+void endRequest(struct request* req, int result, long long measureFrom);
+
+
+
+
+/*******************************************************************************
+ * startRequest
+ * begins a request on a free slot, due at dueUs.
+ *
+ * ****************************************************************************/
+void startRequest(struct request* req, long long dueUs){
+	struct v2Header hdr;
+
+	req->op = ports[1] > 0 && unitRand() >= encShare;
+	req->len = pickSize();
+	if (version == 1){
+		sprintf(req->header, "%c%010d", req->op ? 'D' : 'E', req->len);
+		req->headerLen = 11;
+		req->statusLen = 5;
+		req->crcLen = 0;
+	}
+	else {
+		memset(&hdr, 0, sizeof(hdr));
+		hdr.magic = htons(V2_MAGIC);
+		hdr.version = V2_VERSION;
+		hdr.op = req->op ? 'D' : 'E';
+		hdr.length = htobe64(req->len);
+		req->crcLen = 0;
+		if (binary)
+			hdr.flags |= htons(V2_FLAG_BYTES);
+		hdr.flags |= htons(alphabet << 2);
+		if (useCrc){
+			// message and key are the same text
+			hdr.flags |= htons(V2_FLAG_CRC);
+			req->crc = htonl(crc32c(crc32c(0, text, req->len), text,
+					req->len));
+			req->resultCrc = 0;
+			req->crcLen = 4;
+		}
+		memcpy(req->header, &hdr, sizeof(hdr));
+		req->headerLen = sizeof(hdr);
+		req->statusLen = sizeof(hdr);
+	}
+	req->size = req->headerLen + 2 * req->len + (version == 1) +
+		req->crcLen;
+	req->sent = 0;
+	req->got = 0;
+	req->dueUs = dueUs;
+	req->startUs = nowUs();
+	req->active = 1;
+
+	// reuse this slot's idle connection to that daemon
+	req->connecting = 0;
+	req->fd = req->keep[req->op];
+	req->keep[req->op] = -1;
+	if (req->fd < 0)
+		req->fd = connectDaemon(ports[req->op], &req->connecting);
+	if (req->fd < 0)
+		endRequest(req, -1, 0);
+}
+
+
+
+
+/*******************************************************************************
+ * endRequest
+ * finishes a slot's request: result is 1 when it completed, -1 when it
+ * failed and -2 when the daemon turned it away. It is counted if it was due
+ * inside the measured window. A completed request's connection is kept for
+ * the next; anything else closes it.
+ *
+ * ****************************************************************************/
+void endRequest(struct request* req, int result, long long measureFrom){
+	long long now = nowUs();
+
+	req->active = 0;
+	if (req->dueUs >= measureFrom){
+		if (result == 1){
+			histRecord(&corrected, now - req->dueUs,
+					rate > 0 ? 0 : expectedUs);
+			histRecord(&service, now - req->startUs, 0);
+			completed[req->op]++;
+			bytesDone += req->len;
+		}
+		else if (result == -2)
+			busy++;
+		else
+			failed++;
+	}
+	if (result == 1 && !fresh){
+		req->keep[req->op] = req->fd;
+		return;
+	}
+	if (req->fd >= 0)
+		close(req->fd);
+}
+
+
+
+
+/*******************************************************************************
+ * sendRequest
+ * sends what it can of designator, length, message, '@' and key (in v2,
+ * header, message, key and with -C the checksum).
+ *
+ * ****************************************************************************/
+int sendRequest(struct request* req){
+	struct iovec iov[5];
+	struct msghdr msg;
+	char* parts[5] = { req->header, text, "@", text, (char*)&req->crc };
+	int lens[5] = { req->headerLen, req->len, version == 1, req->len,
+		req->crcLen };
+	int skip = req->sent;
+	int i, n = 0;
+	int charsWritten;
+
+	for (i = 0; i < 5; i++){
+		if (skip >= lens[i]){
+			skip -= lens[i];
+			continue;
+		}
+		iov[n].iov_base = parts[i] + skip;
+		iov[n].iov_len = lens[i] - skip;
+		skip = 0;
+		n++;
+	}
+	memset(&msg, 0, sizeof(msg));
+	msg.msg_iov = iov;
+	msg.msg_iovlen = n;
+
+	charsWritten = sendmsg(req->fd, &msg, MSG_NOSIGNAL);
+	if (charsWritten < 0)
+		return(errno == EAGAIN || errno == EWOULDBLOCK ? 0 : -1);
+	req->sent += charsWritten;
+	return(0);
+}
+
+
+
+
+/*******************************************************************************
+ * recvReply
+ * reads status and result. Returns 1 once the whole reply is in, -2 if the
+ * daemon was too busy, -1 if it failed the request, 0 to wait for more.
+ *
+ * ****************************************************************************/
+int recvReply(struct request* req){
+	static char sink[SINK_SIZE];
+	struct v2Header hdr;
+	long want;
+	int charsRead;
+	uint32_t crc;
+
+	if (req->got < req->statusLen)
+		charsRead = recv(req->fd, req->status + req->got,
+				req->statusLen - req->got, 0);
+	else if (req->got >= req->statusLen + req->len){
+		want = req->got - req->statusLen - req->len;
+		charsRead = recv(req->fd, req->replyCrc + want,
+				req->crcLen - want, 0);
+	}
+	else {
+		want = req->len - (req->got - req->statusLen);
+		charsRead = recv(req->fd, sink, want < SINK_SIZE ? want :
+				SINK_SIZE, 0);
+		if (charsRead > 0 && req->crcLen > 0)
+			req->resultCrc = crc32c(req->resultCrc, sink, charsRead);
+	}
+	if (charsRead < 0)
+		return(errno == EAGAIN || errno == EWOULDBLOCK ? 0 : -1);
+	if (charsRead == 0)
+		return(-1);
+	req->got += charsRead;
+
+	if (req->got == req->statusLen && version == 1){
+		req->status[5] = '\0';
+		if (strcmp(req->status, "retry") == 0)
+			return(-2);
+		if (strcmp(req->status, "goods") != 0)
+			return(-1);
+	}
+	else if (req->got == req->statusLen){
+		memcpy(&hdr, req->status, sizeof(hdr));
+		if (ntohs(hdr.magic) != V2_MAGIC)
+			return(-1);
+		if (ntohs(hdr.status) == V2_RETRY)
+			return(-2);
+		if (ntohs(hdr.status) != V2_OK ||
+				be64toh(hdr.length) != (uint64_t)req->len)
+			return(-1);
+	}
+	if (req->got < req->len + req->statusLen + req->crcLen)
+		return(0);
+	memcpy(&crc, req->replyCrc, 4);
+	if (req->crcLen > 0 && ntohl(crc) != req->resultCrc)
+		return(-1);
+	return(1);
+}
+
+
+
+
+/*******************************************************************************
+ * serviceRequest
+ * handles poll events on a slot's connection.
+ *
+ * ****************************************************************************/
+void serviceRequest(struct request* req, short revents, long long measureFrom){
+	int err = 0;
+	socklen_t errLen = sizeof(err);
+	int result;
+
+	if (req->connecting){
+		if (!(revents & (POLLOUT | POLLERR | POLLHUP)))
+			return;
+		getsockopt(req->fd, SOL_SOCKET, SO_ERROR, &err, &errLen);
+		if (err != 0){
+			endRequest(req, -1, measureFrom);
+			return;
+		}
+		req->connecting = 0;
+	}
+
+	if ((revents & POLLOUT) && req->sent < req->size){
+		if (sendRequest(req) < 0){
+			// the daemon may have said why before hanging up
+			revents |= POLLIN;
+		}
+	}
+	if (revents & (POLLIN | POLLERR | POLLHUP)){
+		result = recvReply(req);
+		if (result != 0)
+			endRequest(req, result, measureFrom);
+	}
+}
+
+
+
+
+/*******************************************************************************
+ * usage
+ *
+ * ****************************************************************************/
+void usage(char* progName){
+	fprintf(stderr, "USAGE: %s [-R rate [-P] | -c connections] "
+		"[-d seconds] [-w seconds]\n"
+		"       %*s [-x encShare] [-s sizes] [-e us] [-n] [-o histfile]\n"
+		"       %*s [-V version] [-C] [-b | -a alphabet]\n"
+		"       %*s encPort [decPort]\n",
+		progName, (int)strlen(progName), "", (int)strlen(progName), "",
+		(int)strlen(progName), "");
+	exit(1);
+}
+
+
+
+
+/*******************************************************************************
+ * main
+ * runs the load for warmup plus duration seconds, lets the requests still
+ * in flight finish, and prints throughput and latency percentiles.
+ *
+ * ****************************************************************************/
+int main(int argc, char* argv[]){
+	struct request* reqs;
+	struct pollfd* pfds;
+	int* pollSlot;          // slot each pollfd belongs to
+	long long* queue;       // open loop: due times not yet started
+	long queueHead = 0, queueTail = 0, queueCap = 1024;
+	long long start, now, measureFrom, stopAt, nextDue, wait;
+	struct timespec waitTs;   // wait, to the microsecond, for ppoll
+	char* histPath = NULL;
+	int opt, i, n, active;
+
+	parseSizes("1K");
+	while ((opt = getopt(argc, argv, "R:Pc:d:w:x:s:e:no:V:Cba:")) != -1){
+		switch (opt){
+			case 'R':
+				rate = atof(optarg);
+				break;
+			case 'P':
+				poisson = 1;
+				break;
+			case 'c':
+				numSlots = atoi(optarg);
+				break;
+			case 'd':
+				duration = atof(optarg);
+				break;
+			case 'w':
+				warmup = atof(optarg);
+				break;
+			case 'x':
+				encShare = atof(optarg);
+				break;
+			case 's':
+				parseSizes(optarg);
+				break;
+			case 'e':
+				expectedUs = atoll(optarg);
+				break;
+			case 'n':
+				fresh = 1;
+				break;
+			case 'o':
+				histPath = optarg;
+				break;
+			case 'V':
+				version = atoi(optarg);
+				if (version != 1 && version != V2_VERSION)
+					usage(argv[0]);
+				break;
+			case 'C':
+				useCrc = 1;
+				break;
+			case 'b':
+				binary = 1;
+				break;
+			case 'a':
+				alphabet = findAlphabet(optarg);
+				if (alphabet < 0)
+					usage(argv[0]);
+				break;
+			default:
+				usage(argv[0]);
+		}
+	}
+	if (argc - optind < 1 || argc - optind > 2 ||
+			(rate <= 0 && numSlots <= 0) ||
+			((useCrc || binary || alphabet) && version == 1) ||
+			(binary && alphabet))
+		usage(argv[0]);
+	ports[0] = atoi(argv[optind]);
+	ports[1] = argc - optind == 2 ? atoi(argv[optind + 1]) : 0;
+
+	// open loop needs a slot for every request it may have in flight
+	if (rate > 0 && numSlots <= 0)
+		numSlots = 4096;
+
+	// and wakes on time: the default 50us timer slack would show up as
+	// queueing too
+	if (rate > 0)
+		prctl(PR_SET_TIMERSLACK, 1);
+	srand(time(NULL) ^ getpid());
+	makeText();
+
+	reqs = calloc(numSlots, sizeof(struct request));
+	pfds = calloc(numSlots, sizeof(struct pollfd));
+	pollSlot = calloc(numSlots, sizeof(int));
+	queue = malloc(queueCap * sizeof(long long));
+	if (reqs == NULL || pfds == NULL || pollSlot == NULL || queue == NULL)
+		error("ERROR allocating memory");
+	for (i = 0; i < numSlots; i++)
+		reqs[i].keep[0] = reqs[i].keep[1] = -1;
+
+	start = nowUs();
+	measureFrom = start + (long long)(warmup * 1e6);
+	stopAt = measureFrom + (long long)(duration * 1e6);
+	nextDue = start;
+
+	while (1){
+		now = nowUs();
+
+		// open loop: everything that has come due joins the queue
+		while (rate > 0 && nextDue <= now && nextDue < stopAt){
+			if (queueTail == queueCap){
+				memmove(queue, queue + queueHead,
+						(queueTail - queueHead) * sizeof(long long));
+				queueTail -= queueHead;
+				queueHead = 0;
+				if (queueTail == queueCap){
+					queueCap *= 2;
+					queue = realloc(queue, queueCap * sizeof(long long));
+					if (queue == NULL)
+						error("ERROR allocating memory");
+				}
+			}
+			queue[queueTail++] = nextDue;
+			nextDue += (long long)(1e6 / rate *
+					(poisson ? -log(1 - unitRand()) : 1));
+		}
+
+		// start requests on free slots
+		active = 0;
+		for (i = 0; i < numSlots; i++){
+			if (!reqs[i].active && now < stopAt + DRAIN_US){
+				if (rate > 0 && queueHead < queueTail)
+					startRequest(&reqs[i], queue[queueHead++]);
+				else if (rate <= 0 && now < stopAt)
+					startRequest(&reqs[i], now);
+			}
+			active += reqs[i].active;
+		}
+		if (now >= stopAt + DRAIN_US ||
+				(now >= stopAt && active == 0 && queueHead == queueTail))
+			break;
+
+		// wait for the sockets, or the next arrival; to the microsecond,
+		// as a send held back to the next millisecond would be counted
+		// as queueing by the corrected latency
+		n = 0;
+		for (i = 0; i < numSlots; i++){
+			if (!reqs[i].active)
+				continue;
+			pfds[n].fd = reqs[i].fd;
+			pfds[n].events = POLLIN;
+			if (reqs[i].connecting || reqs[i].sent < reqs[i].size)
+				pfds[n].events |= POLLOUT;
+			pollSlot[n++] = i;
+		}
+		wait = 100000;
+		if (rate > 0 && nextDue < stopAt && nextDue - now < wait)
+			wait = nextDue - now;
+		if (wait < 0)
+			wait = 0;
+		waitTs.tv_sec = wait / 1000000;
+		waitTs.tv_nsec = (wait % 1000000) * 1000;
+		if (ppoll(pfds, n, &waitTs, NULL) < 0){
+			if (errno == EINTR)
+				continue;
+			error("ERROR polling sockets");
+		}
+		for (i = 0; i < n; i++){
+			if (pfds[i].revents)
+				serviceRequest(&reqs[pollSlot[i]], pfds[i].revents,
+						measureFrom);
+		}
+	}
+
+	// whatever never started or finished counts against the daemon
+	late = queueTail - queueHead;
+	for (i = 0; i < numSlots; i++)
+		late += reqs[i].active;
+
+	if (rate > 0)
+		printf("open loop, %.0f requests/s%s", rate,
+				poisson ? " (Poisson)" : "");
+	else
+		printf("closed loop, %d connections", numSlots);
+	printf(", %.0fs measured after %.0fs warmup, %.0f%% encrypt\n",
+			duration, warmup, (ports[1] > 0 ? encShare : 1) * 100);
+	printf("completed %lld (%lld enc, %lld dec), failed %lld, busy %lld, "
+			"unfinished %lld\n", completed[0] + completed[1],
+			completed[0], completed[1], failed, busy, late);
+	printf("throughput %.1f requests/s, %.2f MB/s of message\n",
+			(completed[0] + completed[1]) / duration,
+			bytesDone / duration / 1e6);
+	printf("\nlatency (us)        p50       p90       p99     p99.9"
+			"    p99.99       max\n");
+	printPercentiles(rate > 0 || expectedUs > 0 ? "corrected" : "latency",
+			&corrected);
+	if (rate > 0 || expectedUs > 0)
+		printPercentiles("service", &service);
+
+	if (histPath != NULL)
+		writeDistribution(histPath, &corrected);
+	return(late > 0 || failed > 0);
+}
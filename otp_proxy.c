@@ -0,0 +1,835 @@
+/*******************************************************************************
+ * otp_proxy.c
+ * Usage: otp_proxy [-i checkMs] <port> <backendPort[,backendPort...]> &
+ * Description - A load balancing front end for a pool of otp_enc_d (or
+ * otp_dec_d) daemons on localhost. Clients connect to port exactly as they
+ * would to a daemon. Each request on a connection, v1 or v2, is relayed to
+ * the backend with the fewest requests in flight: the proxy reads only the
+ * request and reply headers and splices message, key and result between
+ * the sockets, so no message is ever held whole. Multiplexed and streamed
+ * connections are relayed as they are to one backend.
+ *
+ * A checker process asks every backend for its statistics every checkMs
+ * (default 1000) and takes out the ones that do not answer; a backend that
+ * refuses a connection is taken out at once, and one that answers busy is
+ * left alone for the wait it asked for. When every backend is busy the
+ * client is told to retry, and when none is up it is refused. The
+ * designator "S" gets the proxy's own statistics, per backend: whether it
+ * is up, requests in flight and relayed, failures, and a latency histogram.
+ *
+ * ****************************************************************************/
+
+#define _GNU_SOURCE     // splice
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <endian.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/mman.h>
+#include <sys/prctl.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <arpa/inet.h>
+#include <signal.h>
+#include <poll.h>
+#include <fcntl.h>
+#include <time.h>
+#include <errno.h>
+
+#include "protocol.h"
+
+
+
+#define MAX_BACKENDS 64
+#define HIST_BUCKETS 32      // latency histogram, power of two usec buckets
+#define DOWN_WAIT_MS 1000    // retry wait given while every backend is busy
+#define SPLICE_CHUNK 1048576 // most bytes moved by one splice
+
+
+
+/*******************************************************************************
+ * backends
+ * the daemons behind the proxy, kept in an anonymous shared mapping so the
+ * checker and every forked connection see and update the same state with
+ * relaxed atomics.
+ *
+ * ****************************************************************************/
+struct backend {
+	int port;                      // the daemon's port on localhost
+	int up;                        // answered its last check or connection
+	long active;                   // requests being relayed to it now
+	long long busyUntil;           // monotonic ms it asked clients to wait
+	unsigned long requests;        // requests relayed to it
+	unsigned long failures;        // refused connections, lost requests
+	unsigned long latencyHist[HIST_BUCKETS];   // request time in usec
+	unsigned long latencySum;                  // request time in nsec
+};
+
+struct backend* backends;     // points into the shared mapping
+int numBackends = 0;
+
+#define BACKEND_ADD(b, field, n) \
+	__atomic_fetch_add(&backends[b].field, (n), __ATOMIC_RELAXED)
+#define BACKEND_GET(b, field) \
+	__atomic_load_n(&backends[b].field, __ATOMIC_RELAXED)
+#define BACKEND_SET(b, field, v) \
+	__atomic_store_n(&backends[b].field, (v), __ATOMIC_RELAXED)
+
+int backendFD[MAX_BACKENDS];  // a connection's open socket to each backend
+int toBackend[2];             // pipe carrying requests to a backend
+int toClient[2];              // pipe carrying replies to the client
+
+
+
+// Error function used for reporting issues
+void error(const char *msg) {
+	perror(msg);
+	exit(1);
+}
+
+
+
+
+/*******************************************************************************
+ * nowNs
+ * returns the monotonic clock in nanoseconds.
+ *
+ * ****************************************************************************/
+long long nowNs(){
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return((long long)ts.tv_sec * 1000000000LL + ts.tv_nsec);
+}
+
+
+
+
+/*******************************************************************************
+ * histBucket
+ * returns the histogram bucket for value v, ceil(log2(v)) clamped to the
+ * last bucket.
+ *
+ * ****************************************************************************/
+int histBucket(unsigned long v){
+	int b;
+
+	if (v <= 1)
+		return 0;
+	b = 64 - __builtin_clzl(v - 1);
+	if (b >= HIST_BUCKETS)
+		b = HIST_BUCKETS - 1;
+	return b;
+}
+
+
+
+
+/*******************************************************************************
+ * parseBackends
+ * reads the comma separated list of backend ports into the shared mapping.
+ *
+ * ****************************************************************************/
+void parseBackends(char* list){
+	char* next = list;
+	char* end;
+	long port;
+
+	backends = mmap(NULL, MAX_BACKENDS * sizeof(struct backend),
+			PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS,
+			-1, 0);
+	if (backends == MAP_FAILED)
+		error("ERROR mapping backends");
+
+	while (1){
+		port = strtol(next, &end, 10);
+		if (end == next || (*end != ',' && *end != '\0') ||
+				port < 0 || port > 65535 ||
+				numBackends == MAX_BACKENDS){
+			fprintf(stderr, "ERROR: bad backend port list\n");
+			exit(1);
+		}
+		backends[numBackends].port = port;
+		backends[numBackends].up = 1;
+		numBackends++;
+		if (*end == '\0')
+			break;
+		next = end + 1;
+	}
+}
+
+
+
+
+/*******************************************************************************
+ * noDelay
+ * turns Nagle off on a socket. The proxy passes on each request and reply
+ * in pieces, header first, and a piece held back for an ack adds a delayed
+ * ack's wait to every request.
+ *
+ * ****************************************************************************/
+void noDelay(int fd){
+	int on = 1;
+
+	setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &on, sizeof(on));
+}
+
+
+
+
+/*******************************************************************************
+ * connectPort
+ * opens a connection to port on localhost. Returns the socket, or -1 if
+ * nothing accepted it.
+ *
+ * ****************************************************************************/
+int connectPort(int port){
+	struct sockaddr_in address;
+	int fd;
+
+	memset(&address, '\0', sizeof(address));
+	address.sin_family = AF_INET;
+	address.sin_port = htons(port);
+	address.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+
+	fd = socket(AF_INET, SOCK_STREAM, 0);
+	if (fd < 0)
+		error("ERROR opening socket");
+	if (connect(fd, (struct sockaddr*)&address, sizeof(address)) < 0){
+		close(fd);
+		return(-1);
+	}
+	noDelay(fd);
+	return(fd);
+}
+
+
+
+
+/*******************************************************************************
+ * checkBackends
+ * the checker process: every checkMs asks each backend for its statistics
+ * and marks it up if the report comes, down if not. Exits with the proxy.
+ *
+ * ****************************************************************************/
+void checkBackends(int checkMs){
+	struct timeval wait = { 1, 0 };   // longest a backend may take
+	struct timespec pause;
+	char reply[64];
+	int b, fd, got;
+
+	prctl(PR_SET_PDEATHSIG, SIGTERM);
+	pause.tv_sec = checkMs / 1000;
+	pause.tv_nsec = (checkMs % 1000) * 1000000L;
+
+	while (1){
+		for (b = 0; b < numBackends; b++){
+			got = 0;
+			fd = connectPort(backends[b].port);
+			if (fd >= 0){
+				setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &wait,
+						sizeof(wait));
+				if (send(fd, "S", 1, MSG_NOSIGNAL) == 1)
+					got = recv(fd, reply, sizeof(reply),
+							MSG_WAITALL);
+				close(fd);
+			}
+			BACKEND_SET(b, up, got > 0 && reply[0] == '#');
+		}
+		nanosleep(&pause, NULL);
+	}
+}
+
+
+
+
+/*******************************************************************************
+ * pickBackend
+ * the backend that is up and not busy with the fewest requests in flight
+ * (ties to the fewest relayed), with a connection open to it in
+ * backendFD. An idle connection the daemon has since closed is replaced,
+ * and a backend that refuses is marked down and passed over. Returns -1,
+ * with *waitMs set to the wait to give the client, if every backend is
+ * busy, or -2 if none is up.
+ *
+ * ****************************************************************************/
+int pickBackend(long* waitMs){
+	struct pollfd pfd;
+	long long now, until;
+	long active, bestActive = 0;
+	unsigned long done, bestDone = 0;
+	int b, best;
+
+	while (1){
+		now = nowNs() / 1000000;
+		best = -1;
+		*waitMs = -1;
+		for (b = 0; b < numBackends; b++){
+			if (!BACKEND_GET(b, up))
+				continue;
+			until = BACKEND_GET(b, busyUntil);
+			if (until > now){
+				if (*waitMs < 0 || until - now < *waitMs)
+					*waitMs = until - now;
+				continue;
+			}
+			active = BACKEND_GET(b, active);
+			done = BACKEND_GET(b, requests);
+			if (best < 0 || active < bestActive || (active ==
+						bestActive && done < bestDone)){
+				best = b;
+				bestActive = active;
+				bestDone = done;
+			}
+		}
+		if (best < 0)
+			return(*waitMs >= 0 ? -1 : -2);
+
+		// anything to read on an idle connection means it was closed
+		if (backendFD[best] >= 0){
+			pfd.fd = backendFD[best];
+			pfd.events = POLLIN;
+			if (poll(&pfd, 1, 0) == 0)
+				return(best);
+			close(backendFD[best]);
+		}
+		backendFD[best] = connectPort(backends[best].port);
+		if (backendFD[best] >= 0)
+			return(best);
+		BACKEND_SET(best, up, 0);
+		BACKEND_ADD(best, failures, 1);
+	}
+}
+
+
+
+
+/*******************************************************************************
+ * recvAll / sendAll
+ * move exactly len bytes, returning how many moved before the peer went
+ * away.
+ *
+ * ****************************************************************************/
+int recvAll(int fd, char* buff, int len){
+	int got = 0, n;
+
+	while (got < len){
+		n = recv(fd, buff + got, len - got, 0);
+		if (n < 0 && errno == EINTR)
+			continue;
+		if (n <= 0)
+			break;
+		got += n;
+	}
+	return(got);
+}
+
+int sendAll(int fd, const char* buff, int len){
+	int sent = 0, n;
+
+	while (sent < len){
+		n = send(fd, buff + sent, len - sent, MSG_NOSIGNAL);
+		if (n < 0 && errno == EINTR)
+			continue;
+		if (n <= 0)
+			break;
+		sent += n;
+	}
+	return(sent);
+}
+
+
+
+
+/*******************************************************************************
+ * resetPipe
+ * replaces pipe p when a side went away with bytes still in it, as they
+ * belong to a request that is lost.
+ *
+ * ****************************************************************************/
+void resetPipe(int p[2]){
+	close(p[0]);
+	close(p[1]);
+	if (pipe(p) < 0)
+		error("ERROR opening pipe");
+}
+
+
+
+
+/*******************************************************************************
+ * emptyPipe
+ * moves the len bytes waiting in pipe p to socket to. Returns 0, or -1
+ * (with the pipe replaced) if to went away first.
+ *
+ * ****************************************************************************/
+int emptyPipe(int p[2], int to, long len){
+	long n;
+
+	while (len > 0){
+		n = splice(p[0], NULL, to, NULL, len,
+				SPLICE_F_MOVE);
+		if (n < 0 && errno == EINTR)
+			continue;
+		if (n <= 0){
+			resetPipe(p);
+			return(-1);
+		}
+		len -= n;
+	}
+	return(0);
+}
+
+
+
+
+/*******************************************************************************
+ * spliceBytes
+ * moves len bytes from socket from to socket to through pipe p, never into
+ * user space. Returns 0 once they are all across, -1 if from went away
+ * first, or -2 if to did.
+ *
+ * ****************************************************************************/
+int spliceBytes(int from, int to, int p[2], long len){
+	long in;
+
+	while (len > 0){
+		in = splice(from, NULL, p[1], NULL,
+				len < SPLICE_CHUNK ? len : SPLICE_CHUNK,
+				SPLICE_F_MOVE);
+		if (in < 0 && errno == EINTR)
+			continue;
+		if (in <= 0)
+			return(-1);
+		if (emptyPipe(p, to, in) < 0)
+			return(-2);
+		len -= in;
+	}
+	return(0);
+}
+
+
+
+
+/*******************************************************************************
+ * refuse
+ * answers the client itself, in the version it spoke: a retry after waitMs
+ * while every backend is busy (waitMs >= 0), otherwise an error.
+ *
+ * ****************************************************************************/
+void refuse(int clientFD, int version, long waitMs){
+	struct v2Header hdr;
+	char status[32];
+
+	if (version == 2){
+		memset(&hdr, 0, sizeof(hdr));
+		hdr.magic = htons(V2_MAGIC);
+		hdr.version = V2_VERSION;
+		hdr.status = htons(waitMs >= 0 ? V2_RETRY : V2_REJECTED);
+		hdr.length = htobe64(waitMs >= 0 ? waitMs : 0);
+		sendAll(clientFD, (char*)&hdr, sizeof(hdr));
+	}
+	else if (waitMs >= 0){
+		sprintf(status, "retry%010ld", waitMs);
+		sendAll(clientFD, status, 15);
+	}
+	else {
+		sendAll(clientFD, "error", 5);
+	}
+}
+
+
+
+
+/*******************************************************************************
+ * relayRequest
+ * relays one v1 or v2 request, whose first byte is first, to the least
+ * loaded backend and its reply back. Returns 0 if the connection can carry
+ * another request, or -1 if it has to be closed: the backend turned the
+ * request away (and hangs up, as a daemon does), or a side went away.
+ *
+ * ****************************************************************************/
+int relayRequest(int clientFD, char first){
+	struct v2Header hdr, reply;
+	char header[16];      // the request header as it came
+	char status[17];      // the reply status as it came
+	int headerLen, statusLen;
+	int version = (unsigned char)first == V2_MAGIC >> 8 ? 2 : 1;
+	long long start;
+	long length, body, result, waitMs;
+	int b, fd, moved, got, ok = -1;
+
+	// the header says how much message, key and checksum follow
+	header[0] = first;
+	headerLen = version == 2 ? (int)sizeof(hdr) : 11;
+	if (recvAll(clientFD, header + 1, headerLen - 1) < headerLen - 1)
+		return(-1);
+	if (version == 2){
+		memcpy(&hdr, header, sizeof(hdr));
+		length = be64toh(hdr.length);
+		body = 2 * length + ((ntohs(hdr.flags) & V2_FLAG_CRC) ? 4 : 0);
+
+		// a version the daemons do not speak is only answered
+		if (hdr.version != V2_VERSION)
+			body = 0;
+	}
+	else {
+		header[11] = '\0';
+		length = atol(header + 1);
+		body = 2 * length + 1;
+	}
+	if (length < 0)
+		return(-1);
+
+	b = pickBackend(&waitMs);
+	if (b < 0){
+		refuse(clientFD, version, b == -1 ? waitMs : -1);
+		return(-1);
+	}
+	fd = backendFD[b];
+	BACKEND_ADD(b, active, 1);
+	start = nowNs();
+
+	// request out, then the reply status: "goods" (or "error", or "retry"
+	// and the wait) in v1, a header in v2. A daemon that turns a request
+	// away hangs up without reading the rest, but its answer still comes;
+	// a short one, like a v1 daemon's "error" to a v2 header, is passed on.
+	statusLen = version == 2 ? (int)sizeof(reply) : 5;
+	moved = sendAll(fd, header, headerLen) == headerLen ?
+		spliceBytes(clientFD, fd, toBackend, body) : -2;
+	got = moved == -1 ? 0 : recvAll(fd, status, statusLen);
+	if (got < statusLen){
+		if (got > 0)
+			sendAll(clientFD, status, got);
+		else if (moved != -1)
+			BACKEND_ADD(b, failures, 1);
+		goto done;
+	}
+	if (version == 2){
+		memcpy(&reply, status, sizeof(reply));
+		waitMs = be64toh(reply.length);
+		result = be64toh(reply.length) +
+			((ntohs(reply.flags) & V2_FLAG_CRC) ? 4 : 0);
+		ok = ntohs(reply.status) == V2_OK ? 0 : -1;
+		if (ntohs(reply.status) != V2_RETRY)
+			waitMs = -1;
+	}
+	else {
+		status[5] = '\0';
+		result = length;
+		ok = strcmp(status, "goods") == 0 ? 0 : -1;
+		waitMs = -1;
+		if (strcmp(status, "retry") == 0 &&
+				recvAll(fd, status + 5, 10) == 10){
+			statusLen = 15;
+			status[15] = '\0';
+			waitMs = atol(status + 5);
+		}
+	}
+
+	// a busy backend is left alone for as long as it asked
+	if (waitMs >= 0)
+		BACKEND_SET(b, busyUntil, nowNs() / 1000000 + waitMs);
+
+	if (sendAll(clientFD, status, statusLen) < statusLen)
+		ok = -1;
+	else if (ok == 0 && (moved = spliceBytes(fd, clientFD, toClient,
+					result)) < 0){
+		if (moved == -1)
+			BACKEND_ADD(b, failures, 1);
+		ok = -1;
+	}
+	if (ok == 0){
+		start = nowNs() - start;
+		BACKEND_ADD(b, requests, 1);
+		BACKEND_ADD(b, latencySum, start);
+		BACKEND_ADD(b, latencyHist[histBucket(start / 1000)], 1);
+	}
+
+done:
+	BACKEND_ADD(b, active, -1);
+	if (ok < 0){
+		close(fd);
+		backendFD[b] = -1;
+	}
+	return(ok);
+}
+
+
+
+
+/*******************************************************************************
+ * tunnel
+ * relays a multiplexed or streamed connection, whose first byte is first,
+ * to the least loaded backend and passes bytes both ways until both sides
+ * are done. The proxy does not look inside these.
+ *
+ * ****************************************************************************/
+void tunnel(int clientFD, char first){
+	struct pollfd pfd[2];
+	long waitMs, n;
+	int* p;             // the pipe for the direction being moved
+	int b, i, open = 2;
+
+	b = pickBackend(&waitMs);
+	if (b < 0){
+		// the designator said no version, so the answer is v1's
+		refuse(clientFD, 1, b == -1 ? waitMs : -1);
+		return;
+	}
+	BACKEND_ADD(b, active, 1);
+	if (sendAll(backendFD[b], &first, 1) < 1){
+		BACKEND_ADD(b, failures, 1);
+		open = 0;
+	}
+
+	pfd[0].fd = clientFD;
+	pfd[1].fd = backendFD[b];
+	pfd[0].events = pfd[1].events = POLLIN;
+	while (open > 0 && poll(pfd, 2, -1) >= 0){
+		for (i = 0; i < 2; i++){
+			if (pfd[i].fd < 0 || pfd[i].revents == 0)
+				continue;
+			p = i ? toClient : toBackend;
+			n = splice(pfd[i].fd, NULL, p[1], NULL, SPLICE_CHUNK,
+					SPLICE_F_MOVE);
+			if (n > 0 && emptyPipe(p, pfd[!i].fd, n) == 0)
+				continue;
+
+			// one side is done sending: tell the other and stop
+			// reading it
+			shutdown(pfd[!i].fd, SHUT_WR);
+			pfd[i].fd = -1;
+			open--;
+		}
+	}
+	BACKEND_ADD(b, active, -1);
+	BACKEND_ADD(b, requests, 1);
+}
+
+
+
+
+/*******************************************************************************
+ * writeHist
+ * prints one histogram in Prometheus text format. Buckets are stored as
+ * plain counts and made cumulative here. scale converts a bucket bound into
+ * the exported unit.
+ *
+ * ****************************************************************************/
+void writeHist(FILE* out, const char* name, const char* label,
+		unsigned long* hist, double sum, double scale){
+	int i;
+	unsigned long cum = 0;       // running cumulative bucket count
+	const char* sep = label[0] ? "," : "";
+
+	for (i = 0; i < HIST_BUCKETS; i++){
+		cum += __atomic_load_n(&hist[i], __ATOMIC_RELAXED);
+		fprintf(out, "%s_bucket{%s%sle=\"%g\"} %lu\n", name, label, sep,
+				(double)(1UL << i) * scale, cum);
+	}
+	fprintf(out, "%s_bucket{%s%sle=\"+Inf\"} %lu\n", name, label, sep, cum);
+	fprintf(out, "%s_sum%s%s%s %g\n", name, label[0] ? "{" : "", label,
+			label[0] ? "}" : "", sum);
+	fprintf(out, "%s_count%s%s%s %lu\n", name, label[0] ? "{" : "", label,
+			label[0] ? "}" : "", cum);
+}
+
+
+
+
+/*******************************************************************************
+ * sendStats
+ * answers a stats request ("S" designator) with the state and counters of
+ * every backend in Prometheus text exposition format, labelled by port.
+ *
+ * ****************************************************************************/
+void sendStats(int clientFD){
+	FILE* out;          // memory stream the report is built in
+	char* text = NULL;  // the finished report
+	size_t textLen = 0; // and its length
+	char label[32];     // backend="..." label
+	int b;
+
+	out = open_memstream(&text, &textLen);
+	if (out == NULL)
+		error("ERROR building stats");
+
+	fprintf(out, "# HELP otp_proxy_backend_up Whether the backend answered "
+		"its last check.\n"
+		"# TYPE otp_proxy_backend_up gauge\n");
+	for (b = 0; b < numBackends; b++)
+		fprintf(out, "otp_proxy_backend_up{backend=\"%d\"} %d\n",
+				backends[b].port, BACKEND_GET(b, up));
+	fprintf(out, "# HELP otp_proxy_backend_active Requests being relayed "
+		"to the backend.\n"
+		"# TYPE otp_proxy_backend_active gauge\n");
+	for (b = 0; b < numBackends; b++)
+		fprintf(out, "otp_proxy_backend_active{backend=\"%d\"} %ld\n",
+				backends[b].port, BACKEND_GET(b, active));
+	fprintf(out, "# HELP otp_proxy_backend_requests_total Requests and "
+		"tunnelled connections relayed.\n"
+		"# TYPE otp_proxy_backend_requests_total counter\n");
+	for (b = 0; b < numBackends; b++)
+		fprintf(out, "otp_proxy_backend_requests_total{backend=\"%d\"} "
+				"%lu\n", backends[b].port,
+				BACKEND_GET(b, requests));
+	fprintf(out, "# HELP otp_proxy_backend_failures_total Refused "
+		"connections and requests lost on the backend side.\n"
+		"# TYPE otp_proxy_backend_failures_total counter\n");
+	for (b = 0; b < numBackends; b++)
+		fprintf(out, "otp_proxy_backend_failures_total{backend=\"%d\"} "
+				"%lu\n", backends[b].port,
+				BACKEND_GET(b, failures));
+
+	fprintf(out, "# HELP otp_proxy_backend_latency_seconds Time from "
+		"request header to the end of the result.\n"
+		"# TYPE otp_proxy_backend_latency_seconds histogram\n");
+	for (b = 0; b < numBackends; b++){
+		sprintf(label, "backend=\"%d\"", backends[b].port);
+		writeHist(out, "otp_proxy_backend_latency_seconds", label,
+				backends[b].latencyHist,
+				BACKEND_GET(b, latencySum) / 1e9, 1e-6);
+	}
+
+	fclose(out);
+	sendAll(clientFD, text, textLen);
+	free(text);
+}
+
+
+
+
+/*******************************************************************************
+ * serveConnection
+ * runs in the forked child for one client: relays its requests one at a
+ * time until it is done, or tunnels it whole if it is multiplexed or
+ * streamed. Never returns.
+ *
+ * ****************************************************************************/
+void serveConnection(int clientFD){
+	char first;
+	int b;
+
+	for (b = 0; b < numBackends; b++)
+		backendFD[b] = -1;
+	if (pipe(toBackend) < 0 || pipe(toClient) < 0)
+		error("ERROR opening pipe");
+
+	while (recvAll(clientFD, &first, 1) == 1){
+		if (first == 'S'){
+			sendStats(clientFD);
+			break;
+		}
+		if (first != 'E' && first != 'D' &&
+				(unsigned char)first != V2_MAGIC >> 8){
+			tunnel(clientFD, first);
+			break;
+		}
+		if (relayRequest(clientFD, first) < 0)
+			break;
+	}
+	close(clientFD);
+	exit(0);
+}
+
+
+
+
+int main(int argc, char *argv[])
+{
+	int listenSocketFD, estabConnFD, portNumber;
+	struct sockaddr_in serverAddress;
+	pid_t spawnPid;     // forked child process id
+	int opt;            // current command line option
+	int on = 1;         // for setsockopt
+	int checkMs = 1000; // -i: time between health checks
+
+	// Check usage & args
+	while ((opt = getopt(argc, argv, "i:")) != -1){
+		switch (opt){
+			// -i ms: time between health checks
+			case 'i':
+				checkMs = atoi(optarg);
+				if (checkMs < 1)
+					checkMs = 1;
+				break;
+			default:
+				fprintf(stderr, "USAGE: %s [-i checkMs] "
+					"port backendPort[,backendPort...]\n",
+					argv[0]);
+				exit(1);
+		}
+	}
+	if (argc - optind != 2){
+		fprintf(stderr, "USAGE: %s [-i checkMs] port "
+				"backendPort[,backendPort...]\n", argv[0]);
+		exit(1);
+	}
+
+	portNumber = atoi(argv[optind]);
+	if (portNumber < 0 || portNumber > 65535){
+		fprintf(stderr, "ERROR: port number out of range\n");
+		exit(1);
+	}
+	parseBackends(argv[optind + 1]);
+
+	// children are never waited for, and a side that goes away mid
+	// splice is an error return, not a signal
+	signal(SIGCHLD, SIG_IGN);
+	signal(SIGPIPE, SIG_IGN);
+
+	memset((char *)&serverAddress, '\0', sizeof(serverAddress));
+	serverAddress.sin_family = AF_INET;
+	serverAddress.sin_port = htons(portNumber);
+	serverAddress.sin_addr.s_addr = INADDR_ANY;
+
+	listenSocketFD = socket(AF_INET, SOCK_STREAM, 0);
+	if (listenSocketFD < 0)
+		error("ERROR opening socket");
+	setsockopt(listenSocketFD, SOL_SOCKET, SO_REUSEADDR, &on, sizeof(on));
+	if (bind(listenSocketFD, (struct sockaddr *)&serverAddress,
+				sizeof(serverAddress)) < 0)
+		error("ERROR on binding");
+	listen(listenSocketFD, SOMAXCONN);
+
+	// the health checker
+	spawnPid = fork();
+	if (spawnPid < 0)
+		error("ERROR forking new process");
+	if (spawnPid == 0){
+		close(listenSocketFD);
+		checkBackends(checkMs);
+	}
+
+	// a child per client connection, as the daemons do
+	while (1){
+		estabConnFD = accept(listenSocketFD, NULL, NULL);
+		if (estabConnFD < 0){
+			if (errno == EINTR)
+				continue;
+			error("ERROR on accept");
+		}
+
+		spawnPid = fork();
+		switch (spawnPid){
+			case -1:
+				error("ERROR forking new process");
+				break;
+			case 0:
+				close(listenSocketFD);
+				noDelay(estabConnFD);
+				serveConnection(estabConnFD);
+				break;
+			default:
+				close(estabConnFD);
+				break;
+		}
+	}
+
+	close(listenSocketFD);
+	return 0;
+}
@@ -0,0 +1,112 @@
+/*******************************************************************************
+ * protocol.h
+ * Description - protocol v2, defined once for the clients, the daemons,
+ * otp_load and otp_proxy. Besides the v1 exchange (designator, "goods", 10
+ * digit length, message, '@', key) a request may open with a 16 byte
+ * binary header, with the message and key straight after it and no status
+ * to wait for. The reply is the same header carrying the status and the
+ * result's length, then the result. Fields are in network byte order. The
+ * magic's first byte is none of the v1 designators, so every request on a
+ * connection may use either version, and a daemon that only speaks v1
+ * answers the header with "error".
+ *
+ * A header of a version the daemon does not speak is answered
+ * V2_BAD_VERSION with the daemon's in its version field, for the client to
+ * retry with. With V2_FLAG_CRC the request ends in the CRC32C of message
+ * and key, and the reply, flagged the same, in the CRC32C of the result (4
+ * bytes each). V2_FLAG_BYTES selects the binary pad mode, the message
+ * XORed with the key, and otherwise V2_FLAG_ALPHABET picks one of the
+ * alphabets in alphabets.h.
+ *
+ * ****************************************************************************/
+#ifndef PROTOCOL_H
+#define PROTOCOL_H
+
+#include <stdint.h>
+#include <string.h>
+#if defined(__x86_64__)
+#include <nmmintrin.h>   // SSE4.2 crc32
+#endif
+
+#define V2_MAGIC 0xF07A      // first two bytes of every v2 header
+#define V2_VERSION 2         // the header version spoken here
+
+// v2 reply statuses
+#define V2_OK 0              // result follows, length bytes of it
+#define V2_REJECTED 1        // wrong operation, or a malformed header
+#define V2_RETRY 2           // busy, length is the ms to wait
+#define V2_BAD_VERSION 3     // version not spoken, the reply has the daemon's
+#define V2_TOO_LARGE 4       // request over the daemon's memory budget
+#define V2_BAD_CHECKSUM 5    // request did not match its CRC32C
+#define V2_BAD_SYMBOL 6      // message or key not in the request's alphabet
+
+// v2 flags
+#define V2_FLAG_CRC 0x0001   // request and reply end in a CRC32C
+#define V2_FLAG_BYTES 0x0002 // binary pad: any bytes, XORed with the key
+#define V2_FLAG_ALPHABET 0x000C   // the request's alphabet, 0 for ALPHA_TEXT
+#define V2_ALPHABET(flags) (((flags) & V2_FLAG_ALPHABET) >> 2)
+
+struct v2Header {
+	uint16_t magic;          // V2_MAGIC
+	uint8_t version;         // V2_VERSION
+	uint8_t op;              // 'E' or 'D'
+	uint16_t flags;          // V2_FLAG_* bits, the others must be 0
+	uint16_t status;         // replies only
+	uint64_t length;         // message bytes, result bytes or ms to wait
+} __attribute__((packed));
+
+
+
+
+/*******************************************************************************
+ * crc32c
+ * the CRC32C (Castagnoli) of len bytes of buff, carrying on from crc (0 to
+ * start). Eight bytes at a time with the SSE4.2 crc32 instruction when the
+ * CPU has it, otherwise a byte at a time from a table.
+ *
+ * ****************************************************************************/
+#if defined(__x86_64__)
+__attribute__((target("sse4.2")))
+static inline uint32_t crc32cHardware(uint32_t crc, const char* buff,
+		size_t len){
+	uint64_t c = crc;
+	uint64_t word;
+
+	for (; len >= 8; len -= 8, buff += 8){
+		memcpy(&word, buff, 8);
+		c = _mm_crc32_u64(c, word);
+	}
+	for (; len > 0; len--)
+		c = _mm_crc32_u8((uint32_t)c, *buff++);
+	return((uint32_t)c);
+}
+#endif
+
+static inline uint32_t crc32c(uint32_t crc, const char* buff, size_t len){
+	static uint32_t crcTable[256]; // byte at a time table, filled on first use
+	static int crcHardware = -1;   // the CPU has SSE4.2, -1 until asked
+	uint32_t c;
+	int i, j;
+
+#if defined(__x86_64__)
+	if (crcHardware < 0)
+		crcHardware = __builtin_cpu_supports("sse4.2");
+	if (crcHardware)
+		return(~crc32cHardware(~crc, buff, len));
+#endif
+
+	if (crcTable[1] == 0){
+		for (i = 0; i < 256; i++){
+			c = i;
+			for (j = 0; j < 8; j++)
+				c = (c >> 1) ^ ((c & 1) ? 0x82F63B78 : 0);
+			crcTable[i] = c;
+		}
+	}
+	c = ~crc;
+	for (; len > 0; len--)
+		c = crcTable[(c ^ (unsigned char)*buff++) & 0xFF] ^ (c >> 8);
+	return(~c);
+}
+
+#endif